@@ -19,82 +19,626 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "modelserialisation.h"
 #include <QAbstractItemModel>
 #include <QBitArray>
+#include <QBrush>
+#include <QBuffer>
+#include <QColor>
 #include <QDataStream>
 #include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QFileInfo>
+#include <QFont>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QPoint>
+#include <QReadWriteLock>
+#include <QRect>
 #include <QSaveFile>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QSignalBlocker>
+#include <QSize>
+#include <QStandardItemModel>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+#include <QUuid>
+#include <QVector>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#ifdef MODELSERIALISATION_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 namespace ModelSerialisation {
 
-    QString variantToString(const QVariant& val)
+    const char hexDigits[] = "0123456789abcdef";
+    // Value of each ascii character as a hex digit, -1 for characters that are not hex digits
+    const signed char hexValues[128] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+        -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    };
+
+    QString bytesToHex(const QByteArray& data)
+    {
+        const int size = data.size();
+        QString result(size * 2, Qt::Uninitialized);
+        const uchar* source = reinterpret_cast<const uchar*>(data.constData());
+        ushort* destination = reinterpret_cast<ushort*>(result.data());
+        int i = 0;
+#ifdef __SSE2__
+        // Converts 16 bytes to 32 utf-16 hex digits per iteration
+        const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i digitOffset = _mm_set1_epi8('0');
+        const __m128i letterOffset = _mm_set1_epi8('a' - '0' - 10);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16, destination += 32) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+            const __m128i highNibbles = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+            const __m128i lowNibbles = _mm_and_si128(bytes, nibbleMask);
+            __m128i nibbles[2] = { _mm_unpacklo_epi8(highNibbles, lowNibbles), _mm_unpackhi_epi8(highNibbles, lowNibbles) };
+            for (int k = 0; k < 2; ++k) {
+                const __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles[k], nine), letterOffset);
+                const __m128i digits = _mm_add_epi8(_mm_add_epi8(nibbles[k], digitOffset), letters);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * k), _mm_unpacklo_epi8(digits, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * k + 8), _mm_unpackhi_epi8(digits, zero));
+            }
+        }
+#endif
+        for (; i < size; ++i) {
+            *destination++ = hexDigits[source[i] >> 4];
+            *destination++ = hexDigits[source[i] & 0x0f];
+        }
+        return result;
+    }
+
+    bool hexToBytes(const QChar* source, int size, QByteArray& result)
+    {
+        if (size % 2 != 0)
+            return false;
+        result.resize(size / 2);
+        uchar* destination = reinterpret_cast<uchar*>(result.data());
+        for (int i = 0; i < size; i += 2) {
+            const ushort highChar = source[i].unicode();
+            const ushort lowChar = source[i + 1].unicode();
+            if (highChar >= 128 || lowChar >= 128)
+                return false;
+            const signed char highValue = hexValues[highChar];
+            const signed char lowValue = hexValues[lowChar];
+            if ((highValue | lowValue) < 0)
+                return false;
+            *destination++ = static_cast<uchar>((highValue << 4) | lowValue);
+        }
+        return true;
+    }
+
+    QByteArray variantToBytes(const QVariant& val)
     {
-        QString result;
         QByteArray data;
         QDataStream outStream(&data, QIODevice::WriteOnly);
         outStream << val;
-        data = qCompress(data);
-        for (const char* i = data.constBegin(); i != data.constEnd(); ++i) {
-            const QString tempString = QString::number(*reinterpret_cast<const unsigned char*>(i), 16);
-            Q_ASSERT(tempString.size() == 2 || tempString.size() == 1);
-            if (tempString.size() == 1)
-                result += '0';
-            result += tempString;
-        }
-        Q_ASSERT(result.size() % 2 == 0);
-        return result;
+        return data;
     }
 
-    QVariant stringToVariant(const QString& val)
+    QVariant bytesToVariant(const QByteArray& data)
     {
-        QByteArray data;
-        for (int i = 0; i < val.size(); i += 2) {
-            const unsigned char unsignedData = static_cast<unsigned char>(val.midRef(i, 2).toInt(NULL, 16));
-            data.append(*reinterpret_cast<const char*>(&unsignedData));
-        }
-        data = qUncompress(data);
         QDataStream inStream(data);
         QVariant result;
         inStream >> result;
         return result;
     }
 
+    // Values are compressed one by one unless the whole document is compressed
+    QString bytesToString(const QByteArray& data, PayloadEncoding encoding, bool compressPayload)
+    {
+        const QByteArray compressedData = compressPayload ? qCompress(data) : data;
+        if (encoding == Base64Payload)
+            return QString::fromLatin1(compressedData.toBase64());
+        return bytesToHex(compressedData);
+    }
+
+    QString variantToString(const QVariant& val, PayloadEncoding encoding, bool compressPayload)
+    {
+        return bytesToString(variantToBytes(val), encoding, compressPayload);
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    typedef QStringView XmlStringView;
+    inline XmlStringView stringView(const QString& text)
+    {
+        return QStringView(text);
+    }
+    inline XmlStringView stringView(const QString& text, int position, int size)
+    {
+        return QStringView(text).mid(position, size);
+    }
+    inline const char* metaTypeName(int type)
+    {
+        return QMetaType(type).name();
+    }
+    inline int metaTypeId(const QByteArray& name)
+    {
+        return QMetaType::fromName(name).id();
+    }
+#else
+    typedef QStringRef XmlStringView;
+    // The view refers to the string so it must not be a temporary
+    inline XmlStringView stringView(const QString& text)
+    {
+        return QStringRef(&text);
+    }
+    inline XmlStringView stringView(const QString& text, int position, int size)
+    {
+        return QStringRef(&text, position, size);
+    }
+    inline const char* metaTypeName(int type)
+    {
+        return QMetaType::typeName(type);
+    }
+    inline int metaTypeId(const QByteArray& name)
+    {
+        return QMetaType::type(name.constData());
+    }
+#endif
+
+    QVariant stringToVariant(XmlStringView val, PayloadEncoding encoding, bool compressedPayload)
+    {
+        QByteArray data;
+        if (encoding == Base64Payload)
+            data = QByteArray::fromBase64(val.toLatin1());
+        else if (!hexToBytes(val.data(), val.size(), data))
+            return QVariant();
+        if (compressedPayload)
+            data = qUncompress(data);
+        return bytesToVariant(data);
+    }
+
+    // Parses the plain decimal integers written by saveVariant straight from the characters, without going through QLocale
+    template <typename T>
+    bool parseDecimal(XmlStringView text, T& result)
+    {
+        typedef typename std::make_unsigned<T>::type UnsignedType;
+        const QChar* position = text.data();
+        const QChar* const end = position + text.size();
+        const bool negative = position != end && *position == QLatin1Char('-');
+        if (negative) {
+            if (!std::numeric_limits<T>::is_signed)
+                return false;
+            ++position;
+        }
+        if (position == end)
+            return false;
+        const UnsignedType limit = UnsignedType(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+        UnsignedType value = 0;
+        for (; position != end; ++position) {
+            const ushort digit = position->unicode() - ushort('0');
+            if (digit > 9 || value > (limit - digit) / 10)
+                return false;
+            value = value * 10 + digit;
+        }
+        result = negative ? T(UnsignedType(0) - value) : T(value);
+        return true;
+    }
+
+    // Anything parseDecimal doesn't accept goes through the generic conversion so the results don't change
+    template <typename T>
+    T decimalValue(XmlStringView text)
+    {
+        T result;
+        if (parseDecimal(text, result))
+            return result;
+        if (std::numeric_limits<T>::is_signed)
+            return T(text.toLongLong());
+        return T(text.toULongLong());
+    }
+
+    // Values written by a codec start with this character, which can't start a hex or base64 payload.
+    // Values written by a codec start with codecMarker. The string list codec puts codecLengthsSeparator between the lengths and the strings
+    const QLatin1Char codecMarker(':');
+    const QLatin1Char codecLengthsSeparator(';');
+    const QLatin1Char codecFieldSeparator(',');
+
+    // Splits the comma separated fields written by the codecs below, fails unless there are exactly count of them
+    bool codecFields(const QString& text, XmlStringView* fields, int count)
+    {
+        int start = 0;
+        for (int i = 0; i < count; ++i) {
+            const int end = i + 1 < count ? text.indexOf(codecFieldSeparator, start) : text.size();
+            if (end < 0)
+                return false;
+            fields[i] = stringView(text, start, end - start);
+            start = end + 1;
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool codecIntegers(const QString& text, T* values, int count)
+    {
+        XmlStringView fields[4];
+        Q_ASSERT(count <= 4);
+        if (!codecFields(text, fields, count))
+            return false;
+        for (int i = 0; i < count; ++i) {
+            if (!parseDecimal(fields[i], values[i]))
+                return false;
+        }
+        return true;
+    }
+
+    bool codecDoubles(const QString& text, qreal* values, int count)
+    {
+        XmlStringView fields[4];
+        Q_ASSERT(count <= 4);
+        if (!codecFields(text, fields, count))
+            return false;
+        bool valid = true;
+        for (int i = 0; i < count && valid; ++i)
+            values[i] = fields[i].toDouble(&valid);
+        return valid;
+    }
+
+    // Colors are written as their hex rgba when that is exact, other specs and wide colors keep the payload
+    bool encodeColorText(const QColor& color, QString& text)
+    {
+        if (!color.isValid())
+            return true;
+        if (color != QColor::fromRgba(color.rgba()))
+            return false;
+        text += QString::number(color.rgba(), 16);
+        return true;
+    }
+
+    bool decodeColorText(const QString& text, QColor& color)
+    {
+        if (text.isEmpty() || text.size() > 8) {
+            color = QColor();
+            return text.isEmpty();
+        }
+        QRgb rgba = 0;
+        for (const QChar character : text) {
+            const ushort digit = character.unicode();
+            if (digit >= 128 || hexValues[digit] < 0)
+                return false;
+            rgba = (rgba << 4) | QRgb(hexValues[digit]);
+        }
+        color = QColor::fromRgba(rgba);
+        return true;
+    }
+
+    bool encodeColor(const QVariant& value, QString& text)
+    {
+        return encodeColorText(value.value<QColor>(), text);
+    }
+
+    QVariant decodeColor(const QString& text)
+    {
+        QColor color;
+        if (!decodeColorText(text, color))
+            return QVariant();
+        return color;
+    }
+
+    // Only plain brushes, an empty text is Qt::NoBrush
+    bool encodeBrush(const QVariant& value, QString& text)
+    {
+        const QBrush brush = value.value<QBrush>();
+        if (brush.style() == Qt::NoBrush)
+            return true;
+        if (brush.style() != Qt::SolidPattern || !brush.transform().isIdentity() || !brush.color().isValid())
+            return false;
+        return encodeColorText(brush.color(), text);
+    }
+
+    QVariant decodeBrush(const QString& text)
+    {
+        if (text.isEmpty())
+            return QBrush();
+        QColor color;
+        if (!decodeColorText(text, color))
+            return QVariant();
+        return QBrush(color);
+    }
+
+    bool encodeFont(const QVariant& value, QString& text)
+    {
+        const QFont font = value.value<QFont>();
+        const QString fontText = font.toString();
+        // On Qt 5 QFont::toString leaves out properties such as the capitalization, the spacing or the hinting,
+        // a font that doesn't come back unchanged keeps the full payload
+        QFont parsedFont;
+        if (!parsedFont.fromString(fontText) || !(parsedFont == font))
+            return false;
+        text += fontText;
+        return true;
+    }
+
+    QVariant decodeFont(const QString& text)
+    {
+        QFont font;
+        if (!font.fromString(text))
+            return QVariant();
+        return font;
+    }
+
+    bool encodeSize(const QVariant& value, QString& text)
+    {
+        const QSize size = value.toSize();
+        text += QString::number(size.width()) + codecFieldSeparator + QString::number(size.height());
+        return true;
+    }
+
+    QVariant decodeSize(const QString& text)
+    {
+        int values[2];
+        if (!codecIntegers(text, values, 2))
+            return QVariant();
+        return QSize(values[0], values[1]);
+    }
+
+    bool encodeSizeF(const QVariant& value, QString& text)
+    {
+        const QSizeF size = value.toSizeF();
+        text += QString::number(size.width(), 'g', 17) + codecFieldSeparator + QString::number(size.height(), 'g', 17);
+        return true;
+    }
+
+    QVariant decodeSizeF(const QString& text)
+    {
+        qreal values[2];
+        if (!codecDoubles(text, values, 2))
+            return QVariant();
+        return QSizeF(values[0], values[1]);
+    }
+
+    bool encodeRect(const QVariant& value, QString& text)
+    {
+        const QRect rect = value.toRect();
+        text += QString::number(rect.x()) + codecFieldSeparator + QString::number(rect.y())
+            + codecFieldSeparator + QString::number(rect.width()) + codecFieldSeparator + QString::number(rect.height());
+        return true;
+    }
+
+    QVariant decodeRect(const QString& text)
+    {
+        int values[4];
+        if (!codecIntegers(text, values, 4))
+            return QVariant();
+        return QRect(values[0], values[1], values[2], values[3]);
+    }
+
+    bool encodePoint(const QVariant& value, QString& text)
+    {
+        const QPoint point = value.toPoint();
+        text += QString::number(point.x()) + codecFieldSeparator + QString::number(point.y());
+        return true;
+    }
+
+    QVariant decodePoint(const QString& text)
+    {
+        int values[2];
+        if (!codecIntegers(text, values, 2))
+            return QVariant();
+        return QPoint(values[0], values[1]);
+    }
+
+    bool encodeAlignment(const QVariant& value, QString& text)
+    {
+        text += QString::number(int(value.value<Qt::Alignment>()));
+        return true;
+    }
+
+    QVariant decodeAlignment(const QString& text)
+    {
+        int alignment;
+        if (!codecIntegers(text, &alignment, 1))
+            return QVariant();
+        return QVariant::fromValue(Qt::Alignment(alignment));
+    }
+
+    // The raw bytes in base64, without the QDataStream header and the compression of payloads
+    bool encodeByteArray(const QVariant& value, QString& text)
+    {
+        text += QString::fromLatin1(value.toByteArray().toBase64());
+        return true;
+    }
+
+    QVariant decodeByteArray(const QString& text)
+    {
+        return QByteArray::fromBase64(text.toLatin1());
+    }
+
+    // The lengths of the strings then the strings one after the other, so they need no escaping
+    bool encodeStringList(const QVariant& value, QString& text)
+    {
+        const QStringList strings = value.toStringList();
+        for (int i = 0; i < strings.size(); ++i) {
+            if (i > 0)
+                text += codecFieldSeparator;
+            text += QString::number(strings.at(i).size());
+        }
+        text += codecLengthsSeparator;
+        for (const QString& singleString : strings)
+            text += singleString;
+        return true;
+    }
+
+    QVariant decodeStringList(const QString& text)
+    {
+        const int separator = text.indexOf(codecLengthsSeparator);
+        if (separator < 0)
+            return QVariant();
+        QStringList strings;
+        int position = separator + 1;
+        int start = 0;
+        while (start < separator) {
+            int end = text.indexOf(codecFieldSeparator, start);
+            if (end < 0 || end > separator)
+                end = separator;
+            int length;
+            if (!parseDecimal(stringView(text, start, end - start), length) || length > text.size() - position)
+                return QVariant();
+            strings.append(QString(text.constData() + position, length)); // The text refers to the document
+            position += length;
+            start = end + 1;
+        }
+        if (position != text.size())
+            return QVariant();
+        return strings;
+    }
+
+    struct ValueCodec
+    {
+        ValueCodec() : encoder(nullptr), decoder(nullptr) {}
+        ValueCodec(ValueEncoder encoder, ValueDecoder decoder) : encoder(encoder), decoder(decoder) {}
+        ValueEncoder encoder;
+        ValueDecoder decoder;
+    };
+
+    QHash<int, ValueCodec> defaultValueCodecs()
+    {
+        QHash<int, ValueCodec> codecs;
+        codecs.insert(QMetaType::QColor, ValueCodec(encodeColor, decodeColor));
+        codecs.insert(QMetaType::QBrush, ValueCodec(encodeBrush, decodeBrush));
+        codecs.insert(QMetaType::QFont, ValueCodec(encodeFont, decodeFont));
+        codecs.insert(QMetaType::QSize, ValueCodec(encodeSize, decodeSize));
+        codecs.insert(QMetaType::QSizeF, ValueCodec(encodeSizeF, decodeSizeF));
+        codecs.insert(QMetaType::QRect, ValueCodec(encodeRect, decodeRect));
+        codecs.insert(QMetaType::QPoint, ValueCodec(encodePoint, decodePoint));
+        codecs.insert(qMetaTypeId<Qt::Alignment>(), ValueCodec(encodeAlignment, decodeAlignment));
+        codecs.insert(QMetaType::QByteArray, ValueCodec(encodeByteArray, decodeByteArray));
+        codecs.insert(QMetaType::QStringList, ValueCodec(encodeStringList, decodeStringList));
+        return codecs;
+    }
+
+    // Codecs can be registered while documents are saved and loaded on other threads, valueCodecs is only accessed under this lock
+    QReadWriteLock& valueCodecsLock()
+    {
+        static QReadWriteLock lock;
+        return lock;
+    }
+
+    QHash<int, ValueCodec>& valueCodecs()
+    {
+        static QHash<int, ValueCodec> codecs = defaultValueCodecs();
+        return codecs;
+    }
+
+    void registerValueCodec(int type, ValueEncoder encoder, ValueDecoder decoder)
+    {
+        const QWriteLocker locker(&valueCodecsLock());
+        if (encoder && decoder)
+            valueCodecs().insert(type, ValueCodec(encoder, decoder));
+        else
+            valueCodecs().remove(type);
+    }
+
+    // The codec of a type, its functions are null if it has none
+    ValueCodec valueCodec(int type)
+    {
+        const QReadLocker locker(&valueCodecsLock());
+        return valueCodecs().value(type);
+    }
+
+    // The user types with a codec, sorted by id. Their ids change from one run to the next so xml documents list their names once
+    QList<int> userCodecTypes()
+    {
+        QList<int> types;
+        {
+            const QReadLocker locker(&valueCodecsLock());
+            for (QHash<int, ValueCodec>::const_iterator i = valueCodecs().constBegin(); i != valueCodecs().constEnd(); ++i) {
+                if (i.key() >= QMetaType::User)
+                    types.append(i.key());
+            }
+        }
+        std::sort(types.begin(), types.end());
+        return types;
+    }
+
+    // Returns false if the type has no codec or the codec can't represent the value, it is then written as a payload
+    bool encodeWithCodec(const QVariant& val, QString& text)
+    {
+        const ValueCodec codec = valueCodec(val.userType());
+        if (!codec.encoder)
+            return false;
+        text = QString(QChar(codecMarker));
+        return codec.encoder(val, text);
+    }
+
+    // type is the id of the type in this run, see LoadContext::currentType
+    QVariant decodeWithCodec(int type, XmlStringView val)
+    {
+        const ValueCodec codec = valueCodec(type);
+        if (!codec.decoder)
+            return QVariant();
+        // Refers to the characters of the document after the marker instead of copying them
+        const QString text = QString::fromRawData(val.data() + 1, val.size() - 1);
+        return codec.decoder(text);
+    }
 
-    QVariant loadVariant(int type, const QString& val)
+    QVariant loadVariant(int type, XmlStringView val, PayloadEncoding encoding, bool compressedPayload)
     {
         if (val.isEmpty())
             return QVariant();
         switch (type) {
         case QMetaType::UnknownType: return QVariant();
-        case QMetaType::Bool: return val.toInt() == 1;
+        case QMetaType::Bool: return decimalValue<int>(val) == 1;
         case QMetaType::Long:
-        case QMetaType::Int: return val.toInt();
+        case QMetaType::Int: return decimalValue<int>(val);
         case QMetaType::ULong:
-        case QMetaType::UInt: return val.toUInt();
-        case QMetaType::LongLong: return val.toLongLong();
-        case QMetaType::ULongLong: return val.toULongLong();
+        case QMetaType::UInt: return decimalValue<uint>(val);
+        case QMetaType::LongLong: return decimalValue<qlonglong>(val);
+        case QMetaType::ULongLong: return decimalValue<qulonglong>(val);
         case QMetaType::Double: return val.toDouble();
-        case QMetaType::Short: return static_cast<short>(val.toInt());
+        case QMetaType::Short: return static_cast<short>(decimalValue<int>(val));
         case QMetaType::SChar:
-        case QMetaType::Char: return static_cast<char>(val.toInt());
-        case QMetaType::UShort: return static_cast<unsigned short>(val.toUInt());
-        case QMetaType::UChar: return static_cast<unsigned char>(val.toUInt());
+        case QMetaType::Char: return static_cast<char>(decimalValue<int>(val));
+        case QMetaType::UShort: return static_cast<unsigned short>(decimalValue<uint>(val));
+        case QMetaType::UChar: return static_cast<unsigned char>(decimalValue<uint>(val));
         case QMetaType::Float: return val.toFloat();
-        case QMetaType::QString: return val;
-        case QMetaType::QDate: return QDate::fromString(val, Qt::ISODate);
-        case QMetaType::QTime: return QTime::fromString(val, Qt::ISODate);
-        case QMetaType::QDateTime: return QDateTime::fromString(val, Qt::ISODate);
+        case QMetaType::QString: return val.toString();
+        case QMetaType::QDate: return QDate::fromString(val.toString(), Qt::ISODate);
+        case QMetaType::QTime: return QTime::fromString(val.toString(), Qt::ISODate);
+        case QMetaType::QDateTime: return QDateTime::fromString(val.toString(), Qt::ISODate);
         default:
-            return stringToVariant(val);
+            if (val.at(0) == codecMarker)
+                return decodeWithCodec(type, val);
+            return stringToVariant(val, encoding, compressedPayload);
         }
     }
-    QString saveVariant(const QVariant& val)
+    QString saveVariant(const QVariant& val, PayloadEncoding encoding, bool compressPayload, bool* isPayload = nullptr)
     {
+        if (isPayload)
+            *isPayload = false;
         if (val.isNull())
             return QString();
         switch (val.type()) {
         case QMetaType::UnknownType: return QString();
-        case QMetaType::Bool: val.toBool() ? QStringLiteral("1") : QStringLiteral("0");
+        case QMetaType::Bool: return val.toBool() ? QStringLiteral("1") : QStringLiteral("0");
         case QMetaType::Long:
         case QMetaType::Short:
         case QMetaType::Char:
@@ -112,124 +656,2381 @@ namespace ModelSerialisation {
         case QMetaType::QDate: return val.toDate().toString(Qt::ISODate);
         case QMetaType::QTime: return val.toTime().toString(Qt::ISODate);
         case QMetaType::QDateTime: return val.toDateTime().toString(Qt::ISODate);
-        default:
-            return variantToString(val);
+        default: {
+            QString codecText;
+            if (encodeWithCodec(val, codecText))
+                return codecText;
+            if (isPayload)
+                *isPayload = true;
+            return variantToString(val, encoding, compressPayload);
+        }
         }
     }
 
-    void writeElement(QXmlStreamWriter& destination, const QAbstractItemModel* const model, const QList<int>& rolesToSave, const QModelIndex& parent = QModelIndex())
+    // Whether saveVariant writes values of the type as serialised payloads rather than as plain text
+    bool isPayloadType(int type)
     {
-        if (model->rowCount(parent) + model->columnCount(parent) == 0)
-            return;
-        destination.writeStartElement(QStringLiteral("Element"));
-        destination.writeAttribute(QStringLiteral("RowCount"), QString::number(model->rowCount(parent)));
-        destination.writeAttribute(QStringLiteral("ColumnCount"), QString::number(model->columnCount(parent)));
-        for (int i = 0; i < model->rowCount(parent); ++i) {
-            for (int j = 0; j < model->columnCount(parent); ++j) {
-                destination.writeStartElement(QStringLiteral("Cell"));
-                destination.writeStartElement(QStringLiteral("Row"));
-                destination.writeCharacters(QString::number(i));
-                destination.writeEndElement(); // Row
-                destination.writeStartElement(QStringLiteral("Column"));
-                destination.writeCharacters(QString::number(j));
-                destination.writeEndElement(); // Column
-                foreach(int singleRole, rolesToSave)
-                {
-                    const QVariant roleData = model->index(i, j, parent).data(singleRole);
-                    if (roleData.isNull())
-                        continue; // Skip empty roles
-                    const QString roleString = saveVariant(roleData);
-                    if (roleString.isEmpty())
-                        continue; // Skip unhandled types
-                    destination.writeStartElement(QStringLiteral("DataPoint"));
-                    destination.writeAttribute(QStringLiteral("Role"), QString::number(singleRole));
-                    destination.writeAttribute(QStringLiteral("Type"), QString::number(roleData.type()));
-                    destination.writeCharacters(roleString);
-                    destination.writeEndElement(); // DataPoint
-                }
-                if (model->hasChildren(model->index(i, j, parent))) {
-                    writeElement(destination, model, rolesToSave, model->index(i, j, parent));
-                }
-                destination.writeEndElement(); // Cell
-            }
+        switch (type) {
+        case QMetaType::UnknownType:
+        case QMetaType::Bool:
+        case QMetaType::Long:
+        case QMetaType::Short:
+        case QMetaType::Char:
+        case QMetaType::SChar:
+        case QMetaType::Int:
+        case QMetaType::ULong:
+        case QMetaType::UShort:
+        case QMetaType::UChar:
+        case QMetaType::UInt:
+        case QMetaType::LongLong:
+        case QMetaType::ULongLong:
+        case QMetaType::Double:
+        case QMetaType::Float:
+        case QMetaType::QString:
+        case QMetaType::QDate:
+        case QMetaType::QTime:
+        case QMetaType::QDateTime:
+            return false;
+        default:
+            return true;
         }
-        destination.writeEndElement(); // Element
     }
-    bool readElement(QXmlStreamReader& source, QAbstractItemModel* const model, const QModelIndex& parent = QModelIndex())
+
+    // Names looked up while reading xml documents, compared with the views returned by QXmlStreamReader so no string is built for each lookup
+    const QLatin1String cellName("Cell");
+    const QLatin1String rowName("Row");
+    const QLatin1String columnName("Column");
+    const QLatin1String dataPointName("DataPoint");
+    const QLatin1String dataName("Data");
+    const QLatin1String elementName("Element");
+    const QLatin1String rowCountName("RowCount");
+    const QLatin1String columnCountName("ColumnCount");
+    const QLatin1String roleName("Role");
+    const QLatin1String typeName("Type");
+    const QLatin1String valueName("Value");
+    const QLatin1String encodingName("Encoding");
+    const QLatin1String idName("Id");
+    const QLatin1String refName("Ref");
+    const QLatin1String blobOffsetName("BlobOffset");
+    const QLatin1String blobSizeName("BlobSize");
+    const QLatin1String versionName("Version");
+    const QLatin1String majorName("Major");
+    const QLatin1String minorName("Minor");
+    const QLatin1String microName("Micro");
+    const QLatin1String blobFileName("BlobFile");
+    const QLatin1String codecTypeName("CodecType");
+    const QLatin1String nameName("Name");
+    const QLatin1String headerDataName("HeaderData");
+    const QLatin1String horizontalName("Horizontal");
+    const QLatin1String verticalName("Vertical");
+    const QLatin1String headerDataPointName("HeaderDataPoint");
+    const QLatin1String sectionName("Section");
+
+    PayloadEncoding payloadEncoding(const QXmlStreamAttributes& attributes)
     {
-        if (source.name() != QStringLiteral("Element"))
-            return false;
-        int rowCount, colCount;
-        const QXmlStreamAttributes tableSizeAttribute = source.attributes();
-        if (!(
-            tableSizeAttribute.hasAttribute(QStringLiteral("RowCount"))
-            && tableSizeAttribute.hasAttribute(QStringLiteral("ColumnCount"))
-            ))
-            return false;
-        rowCount = tableSizeAttribute.value(QStringLiteral("RowCount")).toInt();
-        colCount = tableSizeAttribute.value(QStringLiteral("ColumnCount")).toInt();
-        if (rowCount <= 0 || colCount <= 0)
-            return false;
-        if (model->rowCount(parent) < rowCount)
-            model->insertRows(model->rowCount(parent), rowCount - model->rowCount(parent), parent);
-        if (model->columnCount(parent) < colCount)
-            model->insertColumns(model->columnCount(parent), colCount - model->columnCount(parent), parent);
-        int rowIndex = -1;
-        int colIndex = -1;
-        bool cellStarted = false;
-        while (!source.atEnd() && !source.hasError()) {
-            source.readNext();
-            if (source.isStartElement()) {
-                if (source.name() == QStringLiteral("Cell")) {
-                    cellStarted = true;
-                }
-                else if (source.name() == QStringLiteral("Row") && cellStarted) {
-                    rowIndex = source.readElementText().toInt();
-                }
-                else if (source.name() == QStringLiteral("Column") && cellStarted) {
-                    colIndex = source.readElementText().toInt();
-                }
-                else if (source.name() == QStringLiteral("DataPoint") && cellStarted) {
-                    if (rowIndex < 0 || colIndex < 0)
-                        return false;
-                    const QXmlStreamAttributes dataPointTattributes = source.attributes();
-                    if (!(
-                        dataPointTattributes.hasAttribute(QStringLiteral("Role"))
-                        && dataPointTattributes.hasAttribute(QStringLiteral("Type"))
-                        ))
-                        return false;
-                    int dataRole = dataPointTattributes.value(QStringLiteral("Role")).toInt();
-                    int dataType = dataPointTattributes.value(QStringLiteral("Type")).toInt();
-                    const QVariant roleVariant = loadVariant(dataType, source.readElementText());
-                    if (!roleVariant.isNull()) // skip unhandled types
-                        model->setData(model->index(rowIndex, colIndex, parent), roleVariant, dataRole);
-                }
-                else if (source.name() == QStringLiteral("Element") && cellStarted) {
-                    if (rowIndex < 0 || colIndex < 0)
-                        return false;
-                    readElement(source, model, model->index(rowIndex, colIndex, parent));
-                }
-            }
-            else if (source.isEndElement()) {
-                if (source.name() == QStringLiteral("Cell")) {
-                    cellStarted = false;
-                    rowIndex = -1;
-                    colIndex = -1;
-                }
-                else if (source.name() == QStringLiteral("Element")) {
-                    if (!cellStarted)
-                        return true;
-                }
-            }
+        // Documents written before the encoding attribute was introduced always use hex
+        if (attributes.value(encodingName) == QLatin1String("Base64"))
+            return Base64Payload;
+        return HexPayload;
+    }
 
+    // Adds the time spent in its scope to a counter, does nothing if the counter is null
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(qint64* counter)
+            : m_counter(counter)
+        {
+            if (m_counter)
+                m_timer.start();
         }
-        return false;
-    }
+        ~ScopedTimer()
+        {
+            if (m_counter)
+                *m_counter += m_timer.nsecsElapsed();
+        }
+    private:
+        Q_DISABLE_COPY(ScopedTimer)
+        qint64* m_counter;
+        QElapsedTimer m_timer;
+    };
 
-    QList<int> modelDefaultRoles()
+    // Collects the statistics of a save or a load and reports them to the observer, an inactive tracker does nothing
+    class OperationTracker
     {
-        return QList<int>()
-            << Qt::DecorationRole
+    public:
+        enum { ProgressInterval = 256 }; // Cells between two progress reports
+        OperationTracker()
+            : m_observer(nullptr)
+            , m_device(nullptr)
+            , m_active(false)
+            , m_cancelled(false)
+        {}
+        OperationTracker(SerialisationObserver* observer, QIODevice* device)
+            : m_observer(observer)
+            , m_device(device)
+            , m_active(observer != nullptr)
+            , m_cancelled(false)
+        {
+            m_timer.start();
+        }
+        // Collects statistics without reporting them, the workers of the parallel save use it
+        static OperationTracker collector(bool active)
+        {
+            OperationTracker result;
+            result.m_active = active;
+            return result;
+        }
+        bool isActive() const { return m_active; }
+        bool isCancelled() const { return m_cancelled; }
+        qint64* encodingTime() { return m_active ? &m_statistics.encodingTime : nullptr; }
+        qint64* modelTime() { return m_active ? &m_statistics.modelTime : nullptr; }
+        const SerialisationStatistics& statistics() const { return m_statistics; }
+        void addCells(qint64 cellCount)
+        {
+            if (m_active)
+                m_statistics.cellsTotal += cellCount;
+        }
+        void addValue(int role, int type, qint64 payloadSize)
+        {
+            if (!m_active)
+                return;
+            SerialisationStatistics::ValueStatistics& roleStatistics = m_statistics.roles[role];
+            ++roleStatistics.count;
+            roleStatistics.payloadSize += payloadSize;
+            SerialisationStatistics::ValueStatistics& typeStatistics = m_statistics.types[type];
+            ++typeStatistics.count;
+            typeStatistics.payloadSize += payloadSize;
+        }
+        void cellDone()
+        {
+            if (m_active && ++m_statistics.cellsProcessed % ProgressInterval == 0)
+                report();
+        }
+        // Counts cells the document leaves out, they are done without being read
+        void cellsDone(qint64 cellCount)
+        {
+            if (!m_active || cellCount <= 0)
+                return;
+            const qint64 previousReports = m_statistics.cellsProcessed / ProgressInterval;
+            m_statistics.cellsProcessed += cellCount;
+            if (m_statistics.cellsProcessed / ProgressInterval != previousReports)
+                report();
+        }
+        void merge(const SerialisationStatistics& other)
+        {
+            if (!m_active)
+                return;
+            m_statistics.cellsProcessed += other.cellsProcessed;
+            m_statistics.cellsTotal += other.cellsTotal;
+            m_statistics.encodingTime += other.encodingTime;
+            m_statistics.modelTime += other.modelTime;
+            mergeValues(m_statistics.roles, other.roles);
+            mergeValues(m_statistics.types, other.types);
+        }
+        void report()
+        {
+            if (!m_observer)
+                return;
+            updateTotals();
+            m_observer->progress(m_statistics);
+            m_cancelled = m_observer->isCancelled();
+        }
+        void finish()
+        {
+            if (!m_observer)
+                return;
+            updateTotals();
+            m_observer->finished(m_statistics);
+        }
+    private:
+        static void mergeValues(QHash<int, SerialisationStatistics::ValueStatistics>& destination, const QHash<int, SerialisationStatistics::ValueStatistics>& source)
+        {
+            for (QHash<int, SerialisationStatistics::ValueStatistics>::const_iterator i = source.constBegin(); i != source.constEnd(); ++i) {
+                SerialisationStatistics::ValueStatistics& values = destination[i.key()];
+                values.count += i.value().count;
+                values.payloadSize += i.value().payloadSize;
+            }
+        }
+        void updateTotals()
+        {
+            m_statistics.totalTime = m_timer.nsecsElapsed();
+            m_statistics.streamTime = qMax<qint64>(0, m_statistics.totalTime - m_statistics.encodingTime - m_statistics.modelTime);
+            if (m_device && !m_device->isSequential())
+                m_statistics.bytesProcessed = m_device->pos();
+        }
+        SerialisationObserver* m_observer;
+        QIODevice* m_device;
+        bool m_active;
+        bool m_cancelled;
+        QElapsedTimer m_timer;
+        SerialisationStatistics m_statistics;
+    };
+
+    // Values in the blob file start at multiples of this so they can be decoded in place once the file is mapped
+    const int blobAlignment = 16;
+
+    // Path of a file in the directory of a document
+    QString siblingPath(const QString& documentPath, const QString& fileName)
+    {
+        return QFileInfo(documentPath).absolutePath() + QLatin1Char('/') + fileName;
+    }
+
+    // Only the exact class is read through its items and built by its adapter, subclasses may reimplement data() or rowCount()
+    bool isStandardItemModel(const QAbstractItemModel* model)
+    {
+        return model->metaObject() == &QStandardItemModel::staticMetaObject;
+    }
+
+    // State shared by the functions writing a document, calls to the model go through it so their time is tracked
+    struct SaveContext
+    {
+        SaveContext(const QAbstractItemModel* const model, const QList<int>& rolesToSave, const SaveOptions& options, const OperationTracker& tracker = OperationTracker())
+            : model(model), rolesToSave(rolesToSave), options(options), tracker(tracker), blobs(nullptr), writeFailed(false)
+            , standardModel(isStandardItemModel(model) ? static_cast<const QStandardItemModel*>(model) : nullptr)
+            , parentItem(nullptr), lastItem(nullptr), editRolePosition(rolesToSave.indexOf(Qt::EditRole))
+        {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+            roleData.reserve(rolesToSave.size());
+            foreach(int singleRole, rolesToSave)
+                roleData.emplace_back(singleRole);
+#endif
+        }
+        int rowCount(const QModelIndex& parent)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            return model->rowCount(parent);
+        }
+        int columnCount(const QModelIndex& parent)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            return model->columnCount(parent);
+        }
+        QModelIndex index(int row, int column, const QModelIndex& parent)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            const QModelIndex result = model->index(row, column, parent);
+            if (standardModel) {
+                // The writers ask for the data and the children of the index they just got, they are read from its item
+                if (!parentItem || parent != itemParent) {
+                    parentItem = standardItem(parent);
+                    itemParent = parent;
+                }
+                lastIndex = result;
+                lastItem = parentItem && result.isValid() ? parentItem->child(row, column) : nullptr;
+            }
+            return result;
+        }
+        bool hasChildren(const QModelIndex& parent)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            if (standardModel && parent.isValid() && parent == lastIndex)
+                return lastItem && lastItem->hasChildren();
+            return model->hasChildren(parent);
+        }
+        // Gets every role to save of a cell with a single call when the model allows it, the result is valid until the next call
+        const QVector<QVariant>& cellData(const QModelIndex& index)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            roleValues.resize(rolesToSave.size());
+            if (standardModel && index.isValid() && index == lastIndex) {
+                // Empty cells have no item, QStandardItem maps the edit role to the display role like the model does
+                for (int i = 0; i < rolesToSave.size(); ++i)
+                    roleValues[i] = lastItem ? lastItem->data(rolesToSave.at(i)) : QVariant();
+                return roleValues;
+            }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+            for (QModelRoleData& singleRoleData : roleData)
+                singleRoleData.clearData();
+            model->multiData(index, QModelRoleDataSpan(roleData.data(), roleData.size()));
+            for (int i = 0; i < rolesToSave.size(); ++i)
+                roleValues[i] = roleData[i].data();
+#else
+            if (options.useItemData) {
+                const QMap<int, QVariant> itemData = model->itemData(index);
+                for (int i = 0; i < rolesToSave.size(); ++i)
+                    roleValues[i] = itemData.value(rolesToSave.at(i));
+                // Models like QStandardItemModel store the edit role as the display role, only the model knows how it maps roles.
+                // That costs a call to data, so it is only made when the edit role is saved
+                if (editRolePosition >= 0 && !itemData.contains(Qt::EditRole))
+                    roleValues[editRolePosition] = model->data(index, Qt::EditRole);
+            }
+            else {
+                for (int i = 0; i < rolesToSave.size(); ++i)
+                    roleValues[i] = model->data(index, rolesToSave.at(i));
+            }
+#endif
+            return roleValues;
+        }
+        QVariant headerData(int section, Qt::Orientation orientation, int role)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            return model->headerData(section, orientation, role);
+        }
+        // Values are only compressed one by one if the whole document is not
+        bool compressPayloads() const
+        {
+            return options.compression == NoCompression;
+        }
+        // Shared values must be written before their references and blobs in the order of the document,
+        // so rows can't be encoded in parallel when either is used
+        bool canSaveInParallel() const
+        {
+            return options.parallelSave && !options.deduplicateValues && !blobs;
+        }
+        bool storesInBlob(const QByteArray& payload) const
+        {
+            return blobs && payload.size() >= options.blobThreshold;
+        }
+        // Appends a value to the blob file
+        bool writeBlob(const QByteArray& payload, qint64* offset)
+        {
+            const qint64 padding = (blobAlignment - blobs->pos() % blobAlignment) % blobAlignment;
+            if (padding > 0 && blobs->write(QByteArray(int(padding), '\0')) != padding)
+                return false;
+            *offset = blobs->pos();
+            return blobs->write(payload) == payload.size();
+        }
+        const QAbstractItemModel* model;
+        QList<int> rolesToSave;
+        SaveOptions options;
+        OperationTracker tracker;
+        QHash<QPair<int, QByteArray>, qint32> valueIds; // Ids of the values written so far by type and serialised content, used by deduplicateValues
+        QIODevice* blobs; // Receives the values of at least blobThreshold bytes, null if they are written in the document
+        QString blobFileName; // The name of the blob file recorded in the document
+        bool writeFailed; // Set when rows written straight to the device could not be written
+        QByteArray subtreeBuffer; // Holds a subtree written to a sequential device until its size is known, keeps its capacity between subtrees
+    private:
+        // The item of an index of standardModel, null for empty cells. Unlike QStandardItemModel::itemFromIndex it never creates one
+        const QStandardItem* standardItem(const QModelIndex& index) const
+        {
+            if (!index.isValid())
+                return standardModel->invisibleRootItem();
+            if (index == lastIndex)
+                return lastItem;
+            const QStandardItem* const parent = standardItem(index.parent());
+            return parent ? parent->child(index.row(), index.column()) : nullptr;
+        }
+        QVector<QVariant> roleValues;
+        const QStandardItemModel* standardModel; // Set when the model is read through its items
+        QModelIndex itemParent; // The parent of the last index handed out and its item
+        const QStandardItem* parentItem;
+        QModelIndex lastIndex; // The last index handed out and its item
+        const QStandardItem* lastItem;
+        int editRolePosition; // Position of Qt::EditRole in rolesToSave, -1 if it is not saved
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        std::vector<QModelRoleData> roleData; // Reused by every call to multiData
+#endif
+    };
+
+    // State shared by the functions reading a document, calls to the model go through it so their time is tracked
+    // A value shared by deduplicateValues. Values defined in parts of the document left out by a query are kept
+    // in their serialised form and only decoded if a loaded cell refers to them
+    struct SharedValue
+    {
+        SharedValue()
+            : type(QMetaType::UnknownType), encoding(HexPayload), decoded(false)
+        {}
+        QVariant value;
+        int type;
+        QString text; // Undecoded xml value
+        PayloadEncoding encoding;
+        QByteArray payload; // Undecoded binary value or value stored in the blob file
+        bool decoded;
+    };
+
+    // Header data read while the content goes to the cells of an adapter, it is set on the model once the content is in place
+    struct HeaderValues
+    {
+        QVector<QMap<int, QVariant> > horizontal;
+        QVector<QMap<int, QVariant> > vertical;
+    };
+
+    struct LoadContext
+    {
+        explicit LoadContext(QAbstractItemModel* const model, const OperationTracker& tracker = OperationTracker())
+            : model(model), minorVersion(0), xmlVersion(XmlVersion1), sharedValues(false), compressedPayloads(true), blobReferences(false), bulkLoad(false), headerValues(nullptr), depth(0), pendingSubtrees(nullptr), tracker(tracker)
+        {
+            // Reserving makes the buffer keep its capacity when it is emptied
+            textBuffer.reserve(256);
+        }
+        // The level being read is above the one selected by the query, only the next cell of the path is read and its values are left out
+        bool isOnPath() const
+        {
+            return depth < query.subtreePath.size();
+        }
+        bool includesCell(int row, int column) const
+        {
+            if (depth < query.subtreePath.size())
+                return query.subtreePath.at(depth) == qMakePair(row, column);
+            if (depth == query.subtreePath.size())
+                return row >= query.firstRow && (query.lastRow < 0 || row <= query.lastRow);
+            return true;
+        }
+        bool includesRole(int role) const
+        {
+            return query.roles.isEmpty() || query.roles.contains(role);
+        }
+        // Whether the children of the cells of the level being read are loaded
+        bool includesChildren() const
+        {
+            return query.maxDepth < 0 || depth - query.subtreePath.size() < query.maxDepth;
+        }
+        // Row of the model a row of the level being read is loaded into
+        int targetRow(int row) const
+        {
+            return depth == query.subtreePath.size() ? row - qMax(query.firstRow, 0) : row;
+        }
+        int targetRowCount(int rowCount) const
+        {
+            if (depth != query.subtreePath.size())
+                return rowCount;
+            const int lastRow = query.lastRow < 0 ? rowCount - 1 : qMin(query.lastRow, rowCount - 1);
+            return qMax(lastRow - qMax(query.firstRow, 0) + 1, 0);
+        }
+        // Section of the model a header section is loaded into, -1 if the query leaves it out
+        int targetSection(int section, Qt::Orientation orientation, int role) const
+        {
+            if (!query.subtreePath.isEmpty() || !includesRole(role))
+                return -1;
+            if (orientation == Qt::Horizontal)
+                return section;
+            if (section < query.firstRow || (query.lastRow >= 0 && section > query.lastRow))
+                return -1;
+            return section - qMax(query.firstRow, 0);
+        }
+        // The id in this run of a type read from the document, user types with a codec are mapped through the names the document lists
+        int currentType(int documentType) const
+        {
+            if (documentType < QMetaType::User || codecTypes.isEmpty())
+                return documentType;
+            return codecTypes.value(documentType, documentType);
+        }
+        // Maps the blob file a document names, it must lie next to the document. Documents of version x.2 that don't name it
+        // use the document path followed by .blobs. If the file can't be mapped the values stored in it fail to load
+        void mapBlobs(const QString& fileName)
+        {
+            if (documentPath.isEmpty() || fileName != QFileInfo(fileName).fileName())
+                return;
+            const QString path = fileName.isEmpty() ? documentPath + QStringLiteral(".blobs") : siblingPath(documentPath, fileName);
+            blobFile.reset(new QFile(path));
+            if (!blobFile->open(QIODevice::ReadOnly) || blobFile->size() == 0 || blobFile->size() > std::numeric_limits<int>::max())
+                return;
+            const uchar* const mappedBlobs = blobFile->map(0, blobFile->size());
+            if (mappedBlobs)
+                blobs = QByteArray::fromRawData(reinterpret_cast<const char*>(mappedBlobs), int(blobFile->size()));
+            else
+                blobs = blobFile->readAll();
+        }
+        // Refers to a value of the blob file without copying it
+        bool blob(qint64 offset, qint64 size, QByteArray& result) const
+        {
+            if (offset < 0 || size < 0 || offset > blobs.size() - size)
+                return false;
+            result = QByteArray::fromRawData(blobs.constData() + offset, int(size));
+            return true;
+        }
+        bool addSharedValue(int valueId, const SharedValue& value)
+        {
+            if (valueId != values.size())
+                return false;
+            values.append(value);
+            return true;
+        }
+        QModelIndex index(int row, int column, const QModelIndex& parent)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            return model->index(row, column, parent);
+        }
+        // Grows the table under parent to at least the given size
+        void ensureSize(const QModelIndex& parent, int rowCount, int colCount)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            if (model->rowCount(parent) < rowCount)
+                model->insertRows(model->rowCount(parent), rowCount - model->rowCount(parent), parent);
+            if (model->columnCount(parent) < colCount)
+                model->insertColumns(model->columnCount(parent), colCount - model->columnCount(parent), parent);
+        }
+        void setItemData(const QModelIndex& index, const QMap<int, QVariant>& roles)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            if (!bulkLoad) {
+                model->setItemData(index, roles);
+                return;
+            }
+            // Notified with the rest of its level by levelLoaded
+            const QSignalBlocker modelBlocker(model);
+            model->setItemData(index, roles);
+        }
+        // With bulkLoad, notifies the values of a level read from the document with a single dataChanged
+        void levelLoaded(const QModelIndex& parent)
+        {
+            if (!bulkLoad || isOnPath())
+                return;
+            const ScopedTimer timer(tracker.modelTime());
+            const int rowCount = model->rowCount(parent);
+            const int colCount = model->columnCount(parent);
+            if (rowCount > 0 && colCount > 0)
+                emit model->dataChanged(model->index(0, 0, parent), model->index(rowCount - 1, colCount - 1, parent));
+        }
+        void setHeaderData(int section, Qt::Orientation orientation, const QVariant& value, int role)
+        {
+            const ScopedTimer timer(tracker.modelTime());
+            if (headerValues) {
+                if (section < 0 || section >= (orientation == Qt::Horizontal ? model->columnCount() : model->rowCount()))
+                    return;
+                QVector<QMap<int, QVariant> >& header = orientation == Qt::Horizontal ? headerValues->horizontal : headerValues->vertical;
+                if (section >= header.size())
+                    header.resize(section + 1);
+                header[section].insert(role, value);
+                return;
+            }
+            if (!bulkLoad) {
+                model->setHeaderData(section, orientation, value, role);
+                return;
+            }
+            // Notified once the document is loaded by loadFromDevice
+            const QSignalBlocker modelBlocker(model);
+            model->setHeaderData(section, orientation, value, role);
+        }
+        QAbstractItemModel* model;
+        qint32 minorVersion; // Minor version of binary documents
+        int xmlVersion; // Major version of xml documents
+        bool sharedValues; // The document was saved with deduplicateValues
+        bool compressedPayloads; // The xml payloads are compressed one by one, false inside compressed documents
+        bool blobReferences; // The payloads of the binary document may be stored in the blob file
+        bool bulkLoad; // Values are set with the model signals blocked and notified once per level, see LoadOptions::bulkLoad
+        HeaderValues* headerValues; // If set the header data is collected here instead of being set on the model
+        QString documentPath; // The path of the document when it is loaded from a file, blob files are looked up next to it
+        QSharedPointer<QFile> blobFile; // Stays open while the document is read so the values can be decoded from the mapping
+        QByteArray blobs; // The mapped blob file, empty if there is none
+        QVector<SharedValue> values; // Values shared by documents saved with deduplicateValues, by id
+        QHash<int, int> codecTypes; // Ids of the user types with a codec in the document mapped to their ids in this run, UnknownType if they are not registered
+        LoadQuery query;
+        int depth; // Depth in the document of the level being read, 0 for the top level
+        QString textBuffer; // Holds the text of the xml element being read, reused for every element
+        QHash<QPersistentModelIndex, qint64>* pendingSubtrees; // If set subtrees are recorded here and skipped instead of read
+        OperationTracker tracker;
+    };
+
+    QString encodeVariant(OperationTracker& tracker, int role, const QVariant& val, PayloadEncoding encoding, bool compressPayload, bool* isPayload)
+    {
+        QString result;
+        {
+            const ScopedTimer timer(tracker.encodingTime());
+            result = saveVariant(val, encoding, compressPayload, isPayload);
+        }
+        if (!result.isEmpty())
+            tracker.addValue(role, val.userType(), result.size());
+        return result;
+    }
+
+    QVariant decodeVariant(OperationTracker& tracker, int role, int type, XmlStringView val, PayloadEncoding encoding, bool compressedPayload)
+    {
+        tracker.addValue(role, type, val.size());
+        const ScopedTimer timer(tracker.encodingTime());
+        return loadVariant(type, val, encoding, compressedPayload);
+    }
+
+    struct XmlDataPoint
+    {
+        int role;
+        int type;
+        QString value;
+        bool isPayload;
+        qint32 valueId; // Id of the shared value, -1 if the value is not shared
+        bool isReference; // The value was written with an earlier data point
+        qint64 blobOffset; // Position of the value in the blob file, -1 if it is written in the document
+        qint64 blobSize;
+    };
+
+    // Returns false for types that can't be saved. With deduplicateValues a payload written before is replaced by its id,
+    // payloads of at least blobThreshold bytes are written raw to the blob file
+    bool encodeXmlValue(SaveContext& context, int role, const QVariant& val, XmlDataPoint& dataPoint)
+    {
+        dataPoint.role = role;
+        dataPoint.type = val.type();
+        dataPoint.valueId = -1;
+        dataPoint.isReference = false;
+        dataPoint.blobOffset = -1;
+        dataPoint.blobSize = 0;
+        if (!isPayloadType(val.type()) || (!context.options.deduplicateValues && !context.blobs)) {
+            dataPoint.value = encodeVariant(context.tracker, role, val, context.options.payloadEncoding, context.compressPayloads(), &dataPoint.isPayload);
+            return !dataPoint.value.isEmpty();
+        }
+        dataPoint.isPayload = true;
+        dataPoint.value.clear();
+        {
+            const ScopedTimer timer(context.tracker.encodingTime());
+            const QByteArray payload = variantToBytes(val);
+            if (context.options.deduplicateValues) {
+                const QPair<int, QByteArray> valueKey(val.userType(), payload);
+                const QHash<QPair<int, QByteArray>, qint32>::const_iterator knownValue = context.valueIds.constFind(valueKey);
+                if (knownValue != context.valueIds.constEnd()) {
+                    dataPoint.valueId = knownValue.value();
+                    dataPoint.isReference = true;
+                }
+                else {
+                    dataPoint.valueId = context.valueIds.size();
+                    context.valueIds.insert(valueKey, dataPoint.valueId);
+                }
+            }
+            if (!dataPoint.isReference) {
+                if (context.storesInBlob(payload)) {
+                    if (!context.writeBlob(payload, &dataPoint.blobOffset))
+                        return false;
+                    dataPoint.blobSize = payload.size();
+                }
+                else {
+                    dataPoint.value = bytesToString(payload, context.options.payloadEncoding, context.compressPayloads());
+                }
+            }
+        }
+        context.tracker.addValue(role, val.userType(), dataPoint.blobOffset >= 0 ? dataPoint.blobSize : dataPoint.value.size());
+        return true;
+    }
+
+    // Writes the attributes telling where the value of a data point is, returns false if the value is written after them
+    bool writeXmlValueLocation(QXmlStreamWriter& destination, const SaveContext& context, const XmlDataPoint& dataPoint)
+    {
+        if (dataPoint.isReference) {
+            destination.writeAttribute(QStringLiteral("Ref"), QString::number(dataPoint.valueId));
+            return true;
+        }
+        if (dataPoint.valueId >= 0)
+            destination.writeAttribute(QStringLiteral("Id"), QString::number(dataPoint.valueId));
+        if (dataPoint.blobOffset >= 0) {
+            destination.writeAttribute(QStringLiteral("BlobOffset"), QString::number(dataPoint.blobOffset));
+            destination.writeAttribute(QStringLiteral("BlobSize"), QString::number(dataPoint.blobSize));
+            return true;
+        }
+        if (dataPoint.isPayload && context.options.payloadEncoding == Base64Payload)
+            destination.writeAttribute(QStringLiteral("Encoding"), QStringLiteral("Base64"));
+        return false;
+    }
+
+    // Reads the text of the element the reader is on into a buffer reused for every element.
+    // The characters are appended from the views of the reader so nothing is allocated once the buffer is large enough
+    bool readXmlText(QXmlStreamReader& source, QString& buffer)
+    {
+        buffer.resize(0);
+        while (!source.atEnd()) {
+            switch (source.readNext()) {
+            case QXmlStreamReader::Characters:
+            case QXmlStreamReader::EntityReference:
+                buffer.append(source.text());
+                break;
+            case QXmlStreamReader::Comment:
+            case QXmlStreamReader::ProcessingInstruction:
+                break;
+            case QXmlStreamReader::EndElement:
+                return true;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Values in the blob file are the raw QDataStream serialisation of the QVariant, decoded straight from the mapped file
+    QVariant decodeBlobVariant(OperationTracker& tracker, int role, int type, const QByteArray& payload)
+    {
+        tracker.addValue(role, type, payload.size());
+        const ScopedTimer timer(tracker.encodingTime());
+        return bytesToVariant(payload);
+    }
+
+    // The attributes of a value element. QXmlStreamReader::attributes() is read in one pass and released before the reader moves on,
+    // a copy kept alive while the reader advances makes it allocate new attribute storage for the next element
+    struct XmlValueAttributes
+    {
+        XmlValueAttributes()
+            : role(0), type(QMetaType::UnknownType), encoding(HexPayload), id(0), ref(0), blobOffset(-1), blobSize(-1)
+            , hasRole(false), hasType(false), hasValue(false), hasId(false), hasRef(false), hasBlob(false)
+        {}
+        int role;
+        int type; // Id of the type in this run, see LoadContext::currentType
+        PayloadEncoding encoding;
+        int id; // The shared value the element defines
+        int ref; // The shared value the element refers to
+        qint64 blobOffset; // -1 if not valid
+        qint64 blobSize;
+        bool hasRole;
+        bool hasType;
+        bool hasValue; // The value is stored in the Value attribute, it was copied to LoadContext::textBuffer
+        bool hasId;
+        bool hasRef;
+        bool hasBlob;
+    };
+
+    XmlValueAttributes readXmlValueAttributes(const QXmlStreamReader& source, LoadContext& context)
+    {
+        XmlValueAttributes result;
+        const QXmlStreamAttributes attributes = source.attributes();
+        for (const QXmlStreamAttribute& attribute : attributes) {
+            const XmlStringView name = attribute.name();
+            const XmlStringView value = attribute.value();
+            bool valid;
+            if (name == roleName) {
+                result.role = decimalValue<int>(value);
+                result.hasRole = true;
+            }
+            else if (name == typeName) {
+                result.type = context.currentType(decimalValue<int>(value));
+                result.hasType = true;
+            }
+            else if (name == valueName) {
+                // Keeps the capacity of the buffer instead of copying the attribute into a new string
+                context.textBuffer.resize(0);
+                context.textBuffer.append(value);
+                result.hasValue = true;
+            }
+            else if (name == encodingName) {
+                // Documents written before the encoding attribute was introduced always use hex
+                result.encoding = value == QLatin1String("Base64") ? Base64Payload : HexPayload;
+            }
+            else if (name == idName) {
+                result.id = value.toInt();
+                result.hasId = true;
+            }
+            else if (name == refName) {
+                result.ref = value.toInt();
+                result.hasRef = true;
+            }
+            else if (name == blobOffsetName) {
+                result.blobOffset = value.toLongLong(&valid);
+                if (!valid)
+                    result.blobOffset = -1;
+                result.hasBlob = true;
+            }
+            else if (name == blobSizeName) {
+                result.blobSize = value.toLongLong(&valid);
+                if (!valid)
+                    result.blobSize = -1;
+            }
+        }
+        return result;
+    }
+
+    // Values shared through the Id and Ref attributes are decoded only where they are first written
+    bool decodeXmlValue(LoadContext& context, const XmlValueAttributes& attributes, XmlStringView text, QVariant& result)
+    {
+        const int role = attributes.role;
+        const int type = attributes.type;
+        if (attributes.hasRef) {
+            const int valueId = attributes.ref;
+            if (valueId < 0 || valueId >= context.values.size())
+                return false;
+            SharedValue& sharedValue = context.values[valueId];
+            if (sharedValue.decoded) {
+                context.tracker.addValue(role, type, 0);
+            }
+            else {
+                if (sharedValue.payload.isNull())
+                    sharedValue.value = decodeVariant(context.tracker, role, sharedValue.type, stringView(sharedValue.text), sharedValue.encoding, context.compressedPayloads);
+                else
+                    sharedValue.value = decodeBlobVariant(context.tracker, role, sharedValue.type, sharedValue.payload);
+                sharedValue.text.clear();
+                sharedValue.payload.clear();
+                sharedValue.decoded = true;
+            }
+            result = sharedValue.value;
+            return true;
+        }
+        if (attributes.hasBlob) {
+            QByteArray payload;
+            if (!context.blob(attributes.blobOffset, attributes.blobSize, payload))
+                return false;
+            result = decodeBlobVariant(context.tracker, role, type, payload);
+        }
+        else {
+            result = decodeVariant(context.tracker, role, type, text, attributes.encoding, context.compressedPayloads);
+        }
+        if (attributes.hasId) {
+            SharedValue sharedValue;
+            sharedValue.value = result;
+            sharedValue.decoded = true;
+            return context.addSharedValue(attributes.id, sharedValue);
+        }
+        return true;
+    }
+
+    // Skips the value element the reader is on without decoding it, shared values are kept for the cells that refer to them
+    bool skipXmlValue(QXmlStreamReader& source, LoadContext& context, const XmlValueAttributes& attributes)
+    {
+        if (!attributes.hasId) {
+            source.skipCurrentElement();
+            return true;
+        }
+        SharedValue sharedValue;
+        sharedValue.type = attributes.type;
+        sharedValue.encoding = attributes.encoding;
+        if (attributes.hasBlob) {
+            if (!context.blob(attributes.blobOffset, attributes.blobSize, sharedValue.payload))
+                return false;
+            source.skipCurrentElement();
+        }
+        else if (attributes.hasValue) {
+            // The buffer is reused by the next element, the shared value gets its own copy
+            sharedValue.text = QString(context.textBuffer.constData(), context.textBuffer.size());
+            source.skipCurrentElement();
+        }
+        else {
+            sharedValue.text = source.readElementText();
+        }
+        return context.addSharedValue(attributes.id, sharedValue);
+    }
+
+    // Reads the RowCount and ColumnCount attributes of the Element the reader is on
+    bool readTableSize(const QXmlStreamReader& source, int& rowCount, int& colCount)
+    {
+        const QXmlStreamAttributes attributes = source.attributes();
+        if (!(
+            attributes.hasAttribute(rowCountName)
+            && attributes.hasAttribute(columnCountName)
+            ))
+            return false;
+        rowCount = attributes.value(rowCountName).toInt();
+        colCount = attributes.value(columnCountName).toInt();
+        return true;
+    }
+
+    // Skips the element the reader is on and everything inside it
+    bool skipXmlElement(QXmlStreamReader& source, LoadContext& context)
+    {
+        if (!context.sharedValues) {
+            source.skipCurrentElement();
+            return !source.hasError();
+        }
+        // The shared values defined inside the element must still be collected
+        int depth = 1;
+        while (depth > 0 && !source.atEnd() && !source.hasError()) {
+            source.readNext();
+            if (source.isStartElement()) {
+                const XmlValueAttributes attributes = readXmlValueAttributes(source, context);
+                if (!attributes.hasId)
+                    ++depth;
+                else if (!skipXmlValue(source, context, attributes))
+                    return false;
+            }
+            else if (source.isEndElement()) {
+                --depth;
+            }
+        }
+        return depth == 0 && !source.hasError();
+    }
+
+    void writeElement(QXmlStreamWriter& destination, SaveContext& context, const QModelIndex& parent = QModelIndex());
+
+    // Values longer than this are written as the text of their element rather than as an attribute in version 2 documents
+    const int attributeValueLimit = 64;
+
+    void writeCompactRow(QXmlStreamWriter& destination, SaveContext& context, const QModelIndex& parent, int i)
+    {
+        // Only the first cell written in a row records the row, the following ones record their column if cells were left out before them
+        const int colCount = context.columnCount(parent);
+        int previousColumn = -1;
+        QVector<XmlDataPoint> dataPoints;
+        XmlDataPoint dataPoint;
+        for (int j = 0; j < colCount && !context.tracker.isCancelled(); ++j) {
+            const QModelIndex cellIndex = context.index(i, j, parent);
+            dataPoints.clear();
+            const QVector<QVariant>& roleValues = context.cellData(cellIndex);
+            for (int k = 0; k < roleValues.size(); ++k) {
+                const int singleRole = context.rolesToSave.at(k);
+                const QVariant& roleData = roleValues.at(k);
+                if (roleData.isNull())
+                    continue; // Skip empty roles
+                if (!encodeXmlValue(context, singleRole, roleData, dataPoint))
+                    continue; // Skip unhandled types
+                dataPoints.append(dataPoint);
+            }
+            const bool hasChildren = context.hasChildren(cellIndex);
+            if (dataPoints.isEmpty() && !hasChildren) {
+                context.tracker.cellDone();
+                continue; // Empty cells are left out
+            }
+            destination.writeStartElement(QStringLiteral("Cell"));
+            if (previousColumn < 0) {
+                destination.writeAttribute(QStringLiteral("Row"), QString::number(i));
+                if (j != 0)
+                    destination.writeAttribute(QStringLiteral("Column"), QString::number(j));
+            }
+            else if (j != previousColumn + 1) {
+                destination.writeAttribute(QStringLiteral("Column"), QString::number(j));
+            }
+            previousColumn = j;
+            for (const XmlDataPoint& cellDataPoint : dataPoints) {
+                destination.writeStartElement(QStringLiteral("Data"));
+                destination.writeAttribute(QStringLiteral("Role"), QString::number(cellDataPoint.role));
+                destination.writeAttribute(QStringLiteral("Type"), QString::number(cellDataPoint.type));
+                if (writeXmlValueLocation(destination, context, cellDataPoint)) {
+                    destination.writeEndElement(); // Data
+                    continue;
+                }
+                if (!cellDataPoint.isPayload && cellDataPoint.value.size() <= attributeValueLimit)
+                    destination.writeAttribute(QStringLiteral("Value"), cellDataPoint.value);
+                else
+                    destination.writeCharacters(cellDataPoint.value);
+                destination.writeEndElement(); // Data
+            }
+            if (hasChildren)
+                writeElement(destination, context, cellIndex);
+            destination.writeEndElement(); // Cell
+            context.tracker.cellDone();
+        }
+    }
+
+    void writeRow(QXmlStreamWriter& destination, SaveContext& context, const QModelIndex& parent, int i)
+    {
+        if (context.options.xmlVersion == XmlVersion2)
+            return writeCompactRow(destination, context, parent, i);
+        const int colCount = context.columnCount(parent);
+        XmlDataPoint dataPoint;
+        for (int j = 0; j < colCount && !context.tracker.isCancelled(); ++j) {
+            const QModelIndex cellIndex = context.index(i, j, parent);
+            destination.writeStartElement(QStringLiteral("Cell"));
+            destination.writeStartElement(QStringLiteral("Row"));
+            destination.writeCharacters(QString::number(i));
+            destination.writeEndElement(); // Row
+            destination.writeStartElement(QStringLiteral("Column"));
+            destination.writeCharacters(QString::number(j));
+            destination.writeEndElement(); // Column
+            const QVector<QVariant>& roleValues = context.cellData(cellIndex);
+            for (int k = 0; k < roleValues.size(); ++k) {
+                const int singleRole = context.rolesToSave.at(k);
+                const QVariant& roleData = roleValues.at(k);
+                if (roleData.isNull())
+                    continue; // Skip empty roles
+                if (!encodeXmlValue(context, singleRole, roleData, dataPoint))
+                    continue; // Skip unhandled types
+                destination.writeStartElement(QStringLiteral("DataPoint"));
+                destination.writeAttribute(QStringLiteral("Role"), QString::number(singleRole));
+                destination.writeAttribute(QStringLiteral("Type"), QString::number(dataPoint.type));
+                if (!writeXmlValueLocation(destination, context, dataPoint))
+                    destination.writeCharacters(dataPoint.value);
+                destination.writeEndElement(); // DataPoint
+            }
+            if (context.hasChildren(cellIndex)) {
+                writeElement(destination, context, cellIndex);
+            }
+            destination.writeEndElement(); // Cell
+            context.tracker.cellDone();
+        }
+    }
+
+    // A top level row encoded by a worker of the parallel save
+    struct EncodedRow
+    {
+        QByteArray data;
+        SerialisationStatistics statistics;
+    };
+
+    // Encodes a top level row into its own buffer, used by the parallel save
+    struct XmlRowEncoder
+    {
+        typedef EncodedRow result_type;
+        XmlRowEncoder(const QAbstractItemModel* const model, const QList<int>& rolesToSave, const SaveOptions& options, bool collectStatistics)
+            : model(model), rolesToSave(rolesToSave), options(options), collectStatistics(collectStatistics)
+        {}
+        EncodedRow operator()(int row) const
+        {
+            EncodedRow result;
+            QBuffer rowBuffer(&result.data);
+            rowBuffer.open(QIODevice::WriteOnly);
+            QXmlStreamWriter writer(&rowBuffer);
+            SaveContext rowContext(model, rolesToSave, options, OperationTracker::collector(collectStatistics));
+            writeRow(writer, rowContext, QModelIndex(), row);
+            result.statistics = rowContext.tracker.statistics();
+            return result;
+        }
+        const QAbstractItemModel* model;
+        QList<int> rolesToSave;
+        SaveOptions options;
+        bool collectStatistics;
+    };
+
+    template <class RowEncoder>
+    bool writeRowsInParallel(QIODevice* destination, OperationTracker& tracker, int rowCount, const RowEncoder& encoder)
+    {
+        // Rows are encoded in batches so only a bounded part of the document is held in memory at once
+        const int batchSize = 16 * qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+        QVector<int> rows;
+        rows.reserve(batchSize);
+        for (int batchStart = 0; batchStart < rowCount; batchStart += batchSize) {
+            if (tracker.isCancelled())
+                return false;
+            rows.clear();
+            for (int i = batchStart; i < qMin(rowCount, batchStart + batchSize); ++i)
+                rows.append(i);
+            const QList<EncodedRow> encodedRows = QtConcurrent::blockingMapped<QList<EncodedRow> >(rows, encoder);
+            foreach(const EncodedRow& encodedRow, encodedRows)
+            {
+                if (destination->write(encodedRow.data) != encodedRow.data.size())
+                    return false;
+                tracker.merge(encodedRow.statistics);
+            }
+            // The workers can't report, the progress is reported once per batch instead
+            tracker.report();
+        }
+        return true;
+    }
+
+    void writeElement(QXmlStreamWriter& destination, SaveContext& context, const QModelIndex& parent)
+    {
+        const int rowCount = context.rowCount(parent);
+        const int colCount = context.columnCount(parent);
+        if (rowCount + colCount == 0)
+            return;
+        context.tracker.addCells(qint64(rowCount) * colCount);
+        destination.writeStartElement(QStringLiteral("Element"));
+        destination.writeAttribute(QStringLiteral("RowCount"), QString::number(rowCount));
+        destination.writeAttribute(QStringLiteral("ColumnCount"), QString::number(colCount));
+        if (context.canSaveInParallel() && !parent.isValid() && rowCount > 1 && colCount > 0) {
+            // Empty characters close the start tag so the rows can go straight to the device
+            destination.writeCharacters(QString());
+            if (!writeRowsInParallel(destination.device(), context.tracker, rowCount, XmlRowEncoder(context.model, context.rolesToSave, context.options, context.tracker.isActive())))
+                context.writeFailed = true; // The rows bypass the writer so it can't record the error itself
+        }
+        else {
+            for (int i = 0; i < rowCount && !context.tracker.isCancelled(); ++i)
+                writeRow(destination, context, parent, i);
+        }
+        destination.writeEndElement(); // Element
+    }
+    bool readElement(QXmlStreamReader& source, LoadContext& context, const QModelIndex& parent = QModelIndex())
+    {
+        if (source.name() != elementName)
+            return false;
+        int rowCount, colCount;
+        if (!readTableSize(source, rowCount, colCount) || rowCount <= 0 || colCount <= 0)
+            return false;
+        if (!context.isOnPath()) {
+            const int targetRowCount = context.targetRowCount(rowCount);
+            context.ensureSize(parent, targetRowCount, colCount);
+            context.tracker.addCells(qint64(targetRowCount) * colCount);
+        }
+        int rowIndex = -1;
+        int colIndex = -1;
+        bool cellStarted = false;
+        // All the roles of a cell are applied at once so the model notifies the change only once
+        QMap<int, QVariant> cellData;
+        while (!source.atEnd() && !source.hasError()) {
+            source.readNext();
+            if (source.isStartElement()) {
+                if (source.name() == cellName) {
+                    cellStarted = true;
+                }
+                else if (source.name() == rowName && cellStarted) {
+                    if (!readXmlText(source, context.textBuffer))
+                        return false;
+                    rowIndex = decimalValue<int>(stringView(context.textBuffer));
+                }
+                else if (source.name() == columnName && cellStarted) {
+                    if (!readXmlText(source, context.textBuffer))
+                        return false;
+                    colIndex = decimalValue<int>(stringView(context.textBuffer));
+                    if (rowIndex >= 0 && !context.includesCell(rowIndex, colIndex)) {
+                        // Skip the rest of the cell, up to its end element
+                        if (!skipXmlElement(source, context))
+                            return false;
+                        cellStarted = false;
+                        rowIndex = -1;
+                        colIndex = -1;
+                    }
+                }
+                else if (source.name() == dataPointName && cellStarted) {
+                    if (rowIndex < 0 || colIndex < 0)
+                        return false;
+                    const XmlValueAttributes dataPointAttributes = readXmlValueAttributes(source, context);
+                    if (!dataPointAttributes.hasRole || !dataPointAttributes.hasType)
+                        return false;
+                    if (context.isOnPath() || !context.includesRole(dataPointAttributes.role)) {
+                        if (!skipXmlValue(source, context, dataPointAttributes))
+                            return false;
+                        continue;
+                    }
+                    QVariant roleVariant;
+                    if (!readXmlText(source, context.textBuffer) || !decodeXmlValue(context, dataPointAttributes, stringView(context.textBuffer), roleVariant))
+                        return false;
+                    if (!roleVariant.isNull()) // skip unhandled types
+                        cellData.insert(dataPointAttributes.role, roleVariant);
+                }
+                else if (source.name() == elementName && cellStarted) {
+                    if (rowIndex < 0 || colIndex < 0)
+                        return false;
+                    if (!context.includesChildren()) {
+                        if (!skipXmlElement(source, context))
+                            return false;
+                        continue;
+                    }
+                    // The children of the last cell of the path are loaded as the top level of the model
+                    const QModelIndex cellIndex = context.isOnPath() ? QModelIndex() : context.index(context.targetRow(rowIndex), colIndex, parent);
+                    if (!cellData.isEmpty()) {
+                        context.setItemData(cellIndex, cellData);
+                        cellData.clear();
+                    }
+                    ++context.depth;
+                    const bool childrenRead = readElement(source, context, cellIndex);
+                    --context.depth;
+                    if (!childrenRead && context.tracker.isCancelled())
+                        return false;
+                }
+            }
+            else if (source.isEndElement()) {
+                if (source.name() == cellName) {
+                    if (!cellData.isEmpty()) {
+                        context.setItemData(context.index(context.targetRow(rowIndex), colIndex, parent), cellData);
+                        cellData.clear();
+                    }
+                    cellStarted = false;
+                    rowIndex = -1;
+                    colIndex = -1;
+                    context.tracker.cellDone();
+                    if (context.tracker.isCancelled())
+                        return false;
+                }
+                else if (source.name() == elementName) {
+                    if (!cellStarted) {
+                        context.levelLoaded(parent);
+                        return true;
+                    }
+                }
+            }
+
+        }
+        return false;
+    }
+
+    bool readCompactElement(QXmlStreamReader& source, LoadContext& context, const QModelIndex& parent = QModelIndex())
+    {
+        int rowCount, colCount;
+        if (!readTableSize(source, rowCount, colCount) || rowCount < 0 || colCount < 0)
+            return false;
+        qint64 levelCellCount = 0;
+        if (!context.isOnPath()) {
+            const int targetRowCount = context.targetRowCount(rowCount);
+            context.ensureSize(parent, targetRowCount, colCount);
+            levelCellCount = qint64(targetRowCount) * colCount;
+            context.tracker.addCells(levelCellCount);
+        }
+        qint64 cellsRead = 0; // Empty cells are left out of the document, they are counted once the level is read
+        int rowIndex = -1;
+        int colIndex = -1;
+        QMap<int, QVariant> cellData;
+        while (source.readNextStartElement()) {
+            if (source.name() != cellName) {
+                source.skipCurrentElement();
+                continue;
+            }
+            {
+                // A cell without coordinates follows the previous one in the same row.
+                // The attributes are released before the reader moves on so it keeps reusing their storage
+                const QXmlStreamAttributes cellAttributes = source.attributes();
+                if (cellAttributes.hasAttribute(rowName)) {
+                    rowIndex = decimalValue<int>(cellAttributes.value(rowName));
+                    colIndex = 0;
+                }
+                else {
+                    ++colIndex;
+                }
+                if (cellAttributes.hasAttribute(columnName))
+                    colIndex = decimalValue<int>(cellAttributes.value(columnName));
+            }
+            if (rowIndex < 0 || rowIndex >= rowCount || colIndex < 0 || colIndex >= colCount)
+                return false;
+            if (!context.includesCell(rowIndex, colIndex)) {
+                if (!skipXmlElement(source, context))
+                    return false;
+                continue;
+            }
+            // The children of the last cell of the path are loaded as the top level of the model
+            const QModelIndex cellIndex = context.isOnPath() ? QModelIndex() : context.index(context.targetRow(rowIndex), colIndex, parent);
+            while (source.readNextStartElement()) {
+                if (source.name() == dataName) {
+                    const XmlValueAttributes dataPointAttributes = readXmlValueAttributes(source, context);
+                    if (!dataPointAttributes.hasRole || !dataPointAttributes.hasType)
+                        return false;
+                    if (context.isOnPath() || !context.includesRole(dataPointAttributes.role)) {
+                        if (!skipXmlValue(source, context, dataPointAttributes))
+                            return false;
+                        continue;
+                    }
+                    // Either way the value ends up in the text buffer
+                    if (dataPointAttributes.hasValue)
+                        source.skipCurrentElement();
+                    else if (!readXmlText(source, context.textBuffer))
+                        return false;
+                    QVariant roleVariant;
+                    if (!decodeXmlValue(context, dataPointAttributes, stringView(context.textBuffer), roleVariant))
+                        return false;
+                    if (!roleVariant.isNull()) // skip unhandled types
+                        cellData.insert(dataPointAttributes.role, roleVariant);
+                }
+                else if (source.name() == elementName) {
+                    if (!context.includesChildren()) {
+                        if (!skipXmlElement(source, context))
+                            return false;
+                        continue;
+                    }
+                    if (!cellData.isEmpty()) {
+                        context.setItemData(cellIndex, cellData);
+                        cellData.clear();
+                    }
+                    ++context.depth;
+                    const bool childrenRead = readCompactElement(source, context, cellIndex);
+                    --context.depth;
+                    if (!childrenRead)
+                        return false;
+                }
+                else {
+                    source.skipCurrentElement();
+                }
+            }
+            if (!cellData.isEmpty()) {
+                context.setItemData(cellIndex, cellData);
+                cellData.clear();
+            }
+            ++cellsRead;
+            context.tracker.cellDone();
+            if (context.tracker.isCancelled())
+                return false;
+        }
+        if (source.hasError())
+            return false;
+        context.tracker.cellsDone(levelCellCount - cellsRead);
+        if (context.tracker.isCancelled())
+            return false;
+        context.levelLoaded(parent);
+        return true;
+    }
+
+    void clearModel(QAbstractItemModel* const model)
+    {
+        model->removeColumns(0, model->columnCount());
+        model->removeRows(0, model->rowCount());
+    }
+
+    // Binary documents start with these bytes followed by the Major, Minor and Micro version
+    const char binaryMagic[] = { 'Q', 'M', 'S', 'B' };
+    const int binaryMagicSize = sizeof(binaryMagic);
+    // Minor version of the binary layout written by this code
+    const qint32 binaryMinorVersion = 3;
+    // Flags recorded in the header from version 1.2
+    enum BinaryDocumentFlag{
+        SharedValuesFlag = 0x1 // Data points carry the id of their value, see deduplicateValues
+        , BlobsFlag = 0x2 // A quint8 before each payload tells if it is replaced by its offset and size in the blob file, see blobThreshold. From version 1.3 the name of the blob file follows the flags
+        , ColumnarFlag = 0x4 // The top level has no children and is stored one column at a time, see columnarLayout
+    };
+    const quint32 knownBinaryDocumentFlags = SharedValuesFlag | BlobsFlag | ColumnarFlag;
+    // Smaller values are not worth sharing, their id would take about as much space
+    const int sharedValueMinimumSize = 16;
+
+    struct BinaryDataPoint
+    {
+        BinaryDataPoint() : role(0), type(QMetaType::UnknownType), valueId(-1), isReference(false), blobOffset(-1) {}
+        qint32 role;
+        qint32 type;
+        QByteArray payload;
+        qint32 valueId; // Id of the shared value, -1 if the value is not shared
+        bool isReference; // The payload was written with an earlier data point
+        qint64 blobOffset; // Position of the payload in the blob file, -1 if it is written in the document
+    };
+
+    bool saveBinaryVariant(const QVariant& val, int streamVersion, QByteArray& payload)
+    {
+        payload.clear();
+        QDataStream outStream(&payload, QIODevice::WriteOnly);
+        outStream.setVersion(streamVersion);
+        if (val.userType() >= QMetaType::User) {
+            // User type ids are not stable across applications, QVariant stores the type name instead
+            outStream << val;
+        }
+        else if (!QMetaType::save(outStream, val.userType(), val.constData())) {
+            return false;
+        }
+        return outStream.status() == QDataStream::Ok;
+    }
+
+    QVariant loadBinaryVariant(int type, const QByteArray& payload, int streamVersion)
+    {
+        QDataStream inStream(payload);
+        inStream.setVersion(streamVersion);
+        QVariant result;
+        if (type >= QMetaType::User) {
+            inStream >> result;
+        }
+        else {
+            if (!QMetaType::isRegistered(type))
+                return QVariant();
+            result = QVariant(type, nullptr);
+            if (!QMetaType::load(inStream, type, result.data()))
+                return QVariant();
+        }
+        if (inStream.status() != QDataStream::Ok)
+            return QVariant();
+        return result;
+    }
+
+    bool encodeBinaryVariant(OperationTracker& tracker, int role, const QVariant& val, int streamVersion, QByteArray& payload)
+    {
+        bool result;
+        {
+            const ScopedTimer timer(tracker.encodingTime());
+            result = saveBinaryVariant(val, streamVersion, payload);
+        }
+        if (result)
+            tracker.addValue(role, val.userType(), payload.size());
+        return result;
+    }
+
+    QVariant decodeBinaryVariant(OperationTracker& tracker, int role, int type, const QByteArray& payload, int streamVersion)
+    {
+        tracker.addValue(role, type, payload.size());
+        const ScopedTimer timer(tracker.encodingTime());
+        return loadBinaryVariant(type, payload, streamVersion);
+    }
+
+    void shareBinaryValue(SaveContext& context, BinaryDataPoint& dataPoint)
+    {
+        dataPoint.valueId = -1;
+        dataPoint.isReference = false;
+        if (dataPoint.payload.size() < sharedValueMinimumSize)
+            return;
+        const QPair<int, QByteArray> valueKey(dataPoint.type, dataPoint.payload);
+        const QHash<QPair<int, QByteArray>, qint32>::const_iterator knownValue = context.valueIds.constFind(valueKey);
+        if (knownValue != context.valueIds.constEnd()) {
+            dataPoint.valueId = knownValue.value();
+            dataPoint.isReference = true;
+            return;
+        }
+        dataPoint.valueId = context.valueIds.size();
+        context.valueIds.insert(valueKey, dataPoint.valueId);
+    }
+
+    void writeBinaryDataPoints(QDataStream& destination, const QVector<BinaryDataPoint>& dataPoints, bool sharedValues = false, bool blobReferences = false)
+    {
+        destination << quint32(dataPoints.size());
+        for (const BinaryDataPoint& dataPoint : dataPoints) {
+            destination << dataPoint.role << dataPoint.type;
+            if (sharedValues)
+                destination << dataPoint.valueId;
+            if (dataPoint.isReference)
+                continue;
+            if (blobReferences)
+                destination << quint8(dataPoint.blobOffset >= 0);
+            if (dataPoint.blobOffset >= 0)
+                destination << dataPoint.blobOffset << qint64(dataPoint.payload.size());
+            else
+                destination << dataPoint.payload;
+        }
+    }
+
+    void writeBinarySubtree(QDataStream& destination, SaveContext& context, const QModelIndex& parent);
+
+    void writeBinaryCell(QDataStream& destination, SaveContext& context, const QModelIndex& cellIndex)
+    {
+        QVector<BinaryDataPoint> dataPoints;
+        BinaryDataPoint dataPoint;
+        const QVector<QVariant>& roleValues = context.cellData(cellIndex);
+        for (int k = 0; k < roleValues.size(); ++k) {
+            const int singleRole = context.rolesToSave.at(k);
+            const QVariant& roleData = roleValues.at(k);
+            if (roleData.isNull())
+                continue; // Skip empty roles
+            if (!encodeBinaryVariant(context.tracker, singleRole, roleData, destination.version(), dataPoint.payload))
+                continue; // Skip unhandled types
+            dataPoint.role = singleRole;
+            dataPoint.type = roleData.userType();
+            if (context.options.deduplicateValues)
+                shareBinaryValue(context, dataPoint);
+            dataPoint.blobOffset = -1;
+            if (!dataPoint.isReference && context.storesInBlob(dataPoint.payload) && !context.writeBlob(dataPoint.payload, &dataPoint.blobOffset))
+                dataPoint.blobOffset = -1; // Keep the payload in the document if the blob file can't take it
+            dataPoints.append(dataPoint);
+        }
+        writeBinaryDataPoints(destination, dataPoints, context.options.deduplicateValues, context.blobs != nullptr);
+        if (context.hasChildren(cellIndex)) {
+            destination << quint8(1);
+            writeBinarySubtree(destination, context, cellIndex);
+        }
+        else {
+            destination << quint8(0);
+        }
+        context.tracker.cellDone();
+    }
+
+    void writeBinaryRow(QDataStream& destination, SaveContext& context, const QModelIndex& parent, int i)
+    {
+        const int colCount = context.columnCount(parent);
+        for (int j = 0; j < colCount; ++j)
+            writeBinaryCell(destination, context, context.index(i, j, parent));
+    }
+
+    // Encodes a top level row into its own buffer, used by the parallel save
+    struct BinaryRowEncoder
+    {
+        typedef EncodedRow result_type;
+        BinaryRowEncoder(const QAbstractItemModel* const model, const QList<int>& rolesToSave, const SaveOptions& options, int streamVersion, bool collectStatistics)
+            : model(model), rolesToSave(rolesToSave), options(options), streamVersion(streamVersion), collectStatistics(collectStatistics)
+        {}
+        EncodedRow operator()(int row) const
+        {
+            EncodedRow result;
+            QDataStream writer(&result.data, QIODevice::WriteOnly);
+            writer.setVersion(streamVersion);
+            SaveContext rowContext(model, rolesToSave, options, OperationTracker::collector(collectStatistics));
+            writeBinaryRow(writer, rowContext, QModelIndex(), row);
+            result.statistics = rowContext.tracker.statistics();
+            return result;
+        }
+        const QAbstractItemModel* model;
+        QList<int> rolesToSave;
+        SaveOptions options;
+        int streamVersion;
+        bool collectStatistics;
+    };
+
+    void writeBinaryElement(QDataStream& destination, SaveContext& context, const QModelIndex& parent = QModelIndex(), bool parallel = false)
+    {
+        const int rowCount = context.rowCount(parent);
+        const int colCount = context.columnCount(parent);
+        context.tracker.addCells(qint64(rowCount) * colCount);
+        destination << qint32(rowCount) << qint32(colCount);
+        if (parallel && rowCount > 1) {
+            if (!writeRowsInParallel(destination.device(), context.tracker, rowCount, BinaryRowEncoder(context.model, context.rolesToSave, context.options, destination.version(), context.tracker.isActive())))
+                destination.setStatus(QDataStream::WriteFailed);
+            return;
+        }
+        for (int i = 0; i < rowCount && !context.tracker.isCancelled(); ++i)
+            writeBinaryRow(destination, context, parent, i);
+    }
+
+    void writeBinarySubtree(QDataStream& destination, SaveContext& context, const QModelIndex& parent)
+    {
+        // The size of the subtree precedes it so readers can skip it or seek straight to it
+        QIODevice* const device = destination.device();
+        if (!device->isSequential()) {
+            const qint64 sizePosition = device->pos();
+            destination << qint64(0);
+            writeBinaryElement(destination, context, parent);
+            const qint64 endPosition = device->pos();
+            device->seek(sizePosition);
+            destination << qint64(endPosition - sizePosition - static_cast<qint64>(sizeof(qint64)));
+            device->seek(endPosition);
+            return;
+        }
+        // Sequential devices can't seek back to the size so the subtree goes through a buffer first.
+        // The levels below it see a device that can seek and patch their sizes in place, so each byte is copied once whatever the depth.
+        // The buffer is reused by the next subtree, only one is pending at a time
+        if (context.subtreeBuffer.capacity() == 0)
+            context.subtreeBuffer.reserve(64 * 1024); // Reserving makes the buffer keep its capacity when it is emptied
+        QBuffer subtreeDevice(&context.subtreeBuffer);
+        subtreeDevice.open(QIODevice::WriteOnly);
+        QDataStream subtreeStream(&subtreeDevice);
+        subtreeStream.setVersion(destination.version());
+        writeBinaryElement(subtreeStream, context, parent);
+        subtreeDevice.close();
+        destination << qint64(context.subtreeBuffer.size());
+        destination.writeRawData(context.subtreeBuffer.constData(), context.subtreeBuffer.size());
+        context.subtreeBuffer.resize(0);
+    }
+
+    void writeBinaryHeaderData(QDataStream& destination, SaveContext& context, Qt::Orientation orientation)
+    {
+        // Header data is saved only for the number of rows and columns in the root table
+        const int sectionCount = orientation == Qt::Horizontal ? context.columnCount(QModelIndex()) : context.rowCount(QModelIndex());
+        QVector<qint32> sections;
+        QVector<BinaryDataPoint> dataPoints;
+        BinaryDataPoint dataPoint;
+        for (int i = 0; i < sectionCount; ++i) {
+            foreach(int singleRole, context.rolesToSave)
+            {
+                const QVariant roleData = context.headerData(i, orientation, singleRole);
+                if (roleData.isNull())
+                    continue;
+                if (!encodeBinaryVariant(context.tracker, singleRole, roleData, destination.version(), dataPoint.payload))
+                    continue; // Skip unhandled types
+                dataPoint.role = singleRole;
+                dataPoint.type = roleData.userType();
+                dataPoints.append(dataPoint);
+                sections.append(i);
+            }
+        }
+        destination << quint32(dataPoints.size());
+        for (int i = 0; i < dataPoints.size(); ++i)
+            destination << sections.at(i) << dataPoints.at(i).role << dataPoints.at(i).type << dataPoints.at(i).payload;
+    }
+
+    // Reads past a serialised QByteArray without copying it
+    bool skipBinaryPayload(QDataStream& source)
+    {
+        quint32 payloadSize;
+        source >> payloadSize;
+        if (source.status() != QDataStream::Ok)
+            return false;
+        if (payloadSize == 0xffffffff) // Null QByteArray
+            return true;
+        return payloadSize <= quint32(std::numeric_limits<int>::max()) && source.skipRawData(int(payloadSize)) == int(payloadSize);
+    }
+
+    // Payloads stored in the blob file are referenced without being copied
+    bool readBinaryPayload(QDataStream& source, LoadContext& context, QByteArray& payload)
+    {
+        quint8 inBlob = 0;
+        if (context.blobReferences)
+            source >> inBlob;
+        if (!inBlob) {
+            source >> payload;
+            return source.status() == QDataStream::Ok;
+        }
+        qint64 blobOffset, blobSize;
+        source >> blobOffset >> blobSize;
+        return source.status() == QDataStream::Ok && context.blob(blobOffset, blobSize, payload);
+    }
+
+    // Reads past the value of a data point without decoding it, shared values are kept for the cells that refer to them
+    bool skipBinaryValue(QDataStream& source, LoadContext& context, qint32 dataType, qint32 valueId)
+    {
+        if (valueId >= 0 && valueId < context.values.size())
+            return true; // References carry no payload
+        if (valueId >= 0) {
+            SharedValue sharedValue;
+            sharedValue.type = dataType;
+            return readBinaryPayload(source, context, sharedValue.payload) && context.addSharedValue(valueId, sharedValue);
+        }
+        quint8 inBlob = 0;
+        if (context.blobReferences)
+            source >> inBlob;
+        if (!inBlob)
+            return skipBinaryPayload(source);
+        qint64 blobOffset, blobSize;
+        source >> blobOffset >> blobSize;
+        return source.status() == QDataStream::Ok;
+    }
+
+    bool skipBinaryElement(QDataStream& source, LoadContext& context);
+
+    bool skipBinarySubtree(QDataStream& source, LoadContext& context, qint64 subtreeSize)
+    {
+        // Subtrees of documents that share values may define values used later so they have to be walked
+        if (subtreeSize < 0 || context.sharedValues)
+            return skipBinaryElement(source, context);
+        while (subtreeSize > 0) {
+            const int chunkSize = int(qMin<qint64>(subtreeSize, std::numeric_limits<int>::max()));
+            if (source.skipRawData(chunkSize) != chunkSize)
+                return false;
+            subtreeSize -= chunkSize;
+        }
+        return true;
+    }
+
+    bool skipBinaryCell(QDataStream& source, LoadContext& context)
+    {
+        qint32 dataRole, dataType;
+        quint32 dataPointCount;
+        quint8 hasChildren;
+        source >> dataPointCount;
+        for (quint32 k = 0; k < dataPointCount; ++k) {
+            qint32 valueId = -1;
+            source >> dataRole >> dataType;
+            if (context.sharedValues)
+                source >> valueId;
+            if (!skipBinaryValue(source, context, dataType, valueId))
+                return false;
+        }
+        source >> hasChildren;
+        if (source.status() != QDataStream::Ok)
+            return false;
+        if (!hasChildren)
+            return true;
+        qint64 subtreeSize = -1;
+        if (context.minorVersion >= 1) {
+            source >> subtreeSize;
+            if (source.status() != QDataStream::Ok || subtreeSize < 0)
+                return false;
+        }
+        return skipBinarySubtree(source, context, subtreeSize);
+    }
+
+    bool skipBinaryElement(QDataStream& source, LoadContext& context)
+    {
+        qint32 rowCount, colCount;
+        source >> rowCount >> colCount;
+        if (source.status() != QDataStream::Ok || rowCount < 0 || colCount < 0)
+            return false;
+        for (qint64 i = qint64(rowCount) * colCount; i > 0; --i) {
+            if (!skipBinaryCell(source, context))
+                return false;
+        }
+        return true;
+    }
+
+    bool readBinaryElement(QDataStream& source, LoadContext& context, const QModelIndex& parent = QModelIndex());
+
+    bool readBinaryCell(QDataStream& source, LoadContext& context, const QModelIndex& cellIndex)
+    {
+        qint32 dataRole, dataType;
+        quint32 dataPointCount;
+        quint8 hasChildren;
+        QByteArray payload;
+        QMap<int, QVariant> cellData;
+        source >> dataPointCount;
+        for (quint32 k = 0; k < dataPointCount; ++k) {
+            qint32 valueId = -1;
+            source >> dataRole >> dataType;
+            if (context.sharedValues)
+                source >> valueId;
+            if (context.isOnPath() || !context.includesRole(dataRole)) {
+                if (!skipBinaryValue(source, context, dataType, valueId))
+                    return false;
+                continue;
+            }
+            QVariant roleVariant;
+            if (valueId >= 0 && valueId < context.values.size()) {
+                SharedValue& sharedValue = context.values[valueId];
+                if (sharedValue.decoded) {
+                    context.tracker.addValue(dataRole, dataType, 0);
+                }
+                else {
+                    sharedValue.value = decodeBinaryVariant(context.tracker, dataRole, sharedValue.type, sharedValue.payload, source.version());
+                    sharedValue.payload.clear();
+                    sharedValue.decoded = true;
+                }
+                roleVariant = sharedValue.value;
+            }
+            else {
+                if (!readBinaryPayload(source, context, payload))
+                    return false;
+                roleVariant = decodeBinaryVariant(context.tracker, dataRole, dataType, payload, source.version());
+                if (valueId >= 0) {
+                    SharedValue sharedValue;
+                    sharedValue.value = roleVariant;
+                    sharedValue.decoded = true;
+                    if (!context.addSharedValue(valueId, sharedValue))
+                        return false;
+                }
+            }
+            if (!roleVariant.isNull()) // skip unhandled types
+                cellData.insert(dataRole, roleVariant);
+        }
+        if (source.status() != QDataStream::Ok)
+            return false;
+        if (!cellData.isEmpty())
+            context.setItemData(cellIndex, cellData);
+        context.tracker.cellDone();
+        source >> hasChildren;
+        if (source.status() != QDataStream::Ok)
+            return false;
+        if (!hasChildren)
+            return true;
+        qint64 subtreeSize = -1;
+        if (context.minorVersion >= 1) { // Documents from version 1.1 record the size of each subtree
+            source >> subtreeSize;
+            if (source.status() != QDataStream::Ok || subtreeSize < 0)
+                return false;
+        }
+        if (!context.includesChildren())
+            return skipBinarySubtree(source, context, subtreeSize);
+        if (context.pendingSubtrees && subtreeSize >= 0) {
+            // Remember where the subtree starts and leave it for later
+            QIODevice* const device = source.device();
+            const qint64 subtreePosition = device->pos();
+            if (cellIndex.isValid())
+                context.pendingSubtrees->insert(cellIndex, subtreePosition);
+            return device->seek(subtreePosition + subtreeSize);
+        }
+        ++context.depth;
+        const bool childrenRead = readBinaryElement(source, context, cellIndex);
+        --context.depth;
+        return childrenRead;
+    }
+
+    bool readBinaryRow(QDataStream& source, LoadContext& context, const QModelIndex& parent, int i, int colCount)
+    {
+        for (int j = 0; j < colCount; ++j) {
+            bool cellRead;
+            if (!context.includesCell(i, j))
+                cellRead = skipBinaryCell(source, context);
+            else if (context.isOnPath()) // The children of the last cell of the path are loaded as the top level of the model
+                cellRead = readBinaryCell(source, context, QModelIndex());
+            else
+                cellRead = readBinaryCell(source, context, context.index(context.targetRow(i), j, parent));
+            if (!cellRead || context.tracker.isCancelled())
+                return false;
+        }
+        return true;
+    }
+
+    bool readBinaryElement(QDataStream& source, LoadContext& context, const QModelIndex& parent)
+    {
+        qint32 rowCount, colCount;
+        source >> rowCount >> colCount;
+        if (source.status() != QDataStream::Ok || rowCount < 0 || colCount < 0)
+            return false;
+        if (!context.isOnPath()) {
+            const int targetRowCount = context.targetRowCount(rowCount);
+            context.ensureSize(parent, targetRowCount, colCount);
+            context.tracker.addCells(qint64(targetRowCount) * colCount);
+        }
+        for (int i = 0; i < rowCount; ++i) {
+            if (!readBinaryRow(source, context, parent, i, colCount))
+                return false;
+        }
+        context.levelLoaded(parent);
+        return true;
+    }
+
+    bool readBinaryHeaderData(QDataStream& source, LoadContext& context, Qt::Orientation orientation)
+    {
+        quint32 dataPointCount;
+        qint32 headerSection, headerRole, headerType;
+        QByteArray payload;
+        source >> dataPointCount;
+        for (quint32 i = 0; i < dataPointCount; ++i) {
+            source >> headerSection >> headerRole >> headerType;
+            const int targetSection = context.targetSection(headerSection, orientation, headerRole);
+            if (targetSection < 0) {
+                if (!skipBinaryPayload(source))
+                    return false;
+                continue;
+            }
+            source >> payload;
+            if (source.status() != QDataStream::Ok)
+                return false;
+            const QVariant roleVariant = decodeBinaryVariant(context.tracker, headerRole, headerType, payload, source.version());
+            if (!roleVariant.isNull()) // skip unhandled types
+                context.setHeaderData(targetSection, orientation, roleVariant, headerRole);
+        }
+        return source.status() == QDataStream::Ok;
+    }
+
+    // The values of one role of a column of a columnar document that have the same type
+    struct ColumnArray
+    {
+        ColumnArray() : role(0), type(QMetaType::UnknownType), valuePosition(0), sizePosition(0) {}
+        qint32 role;
+        qint32 type;
+        QBitArray present; // Rows holding a value
+        QByteArray sizes; // Little endian qint32 length of each string in characters or of each payload in bytes, empty for fixed width types
+        QByteArray values; // Fixed width little endian numbers, utf-16 little endian characters or QDataStream payloads one after the other
+        int valuePosition; // Read position in values
+        int sizePosition; // Read position in sizes
+    };
+
+    // Size of the values of the types stored as fixed width numbers, 0 for the types whose values are stored with their size
+    int columnValueWidth(int type)
+    {
+        switch (type) {
+        case QMetaType::Bool: return 1;
+        case QMetaType::Int:
+        case QMetaType::UInt:
+        case QMetaType::Float: return 4;
+        case QMetaType::LongLong:
+        case QMetaType::ULongLong:
+        case QMetaType::Double: return 8;
+        default:
+            return 0;
+        }
+    }
+
+    template <typename T>
+    void appendLittleEndian(QByteArray& destination, T value)
+    {
+        const T littleEndianValue = qToLittleEndian(value);
+        destination.append(reinterpret_cast<const char*>(&littleEndianValue), sizeof(T));
+    }
+
+    void appendColumnString(ColumnArray& array, const QString& text)
+    {
+        appendLittleEndian(array.sizes, qint32(text.size()));
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        array.values.append(reinterpret_cast<const char*>(text.utf16()), text.size() * 2);
+#else
+        for (const QChar character : text)
+            appendLittleEndian(array.values, character.unicode());
+#endif
+    }
+
+    // Returns false for types that can't be saved
+    bool encodeColumnValue(OperationTracker& tracker, ColumnArray& array, const QVariant& val, int streamVersion)
+    {
+        const int previousSize = array.values.size();
+        {
+            const ScopedTimer timer(tracker.encodingTime());
+            switch (array.type) {
+            case QMetaType::Bool: array.values.append(char(val.toBool())); break;
+            case QMetaType::Int: appendLittleEndian(array.values, qint32(val.toInt())); break;
+            case QMetaType::UInt: appendLittleEndian(array.values, quint32(val.toUInt())); break;
+            case QMetaType::LongLong: appendLittleEndian(array.values, qint64(val.toLongLong())); break;
+            case QMetaType::ULongLong: appendLittleEndian(array.values, quint64(val.toULongLong())); break;
+            case QMetaType::Float: {
+                const float number = val.toFloat();
+                quint32 bits;
+                std::memcpy(&bits, &number, sizeof(bits));
+                appendLittleEndian(array.values, bits);
+                break;
+            }
+            case QMetaType::Double: {
+                const double number = val.toDouble();
+                quint64 bits;
+                std::memcpy(&bits, &number, sizeof(bits));
+                appendLittleEndian(array.values, bits);
+                break;
+            }
+            case QMetaType::QString: appendColumnString(array, val.toString()); break;
+            default: {
+                QByteArray payload;
+                if (!saveBinaryVariant(val, streamVersion, payload))
+                    return false;
+                appendLittleEndian(array.sizes, qint32(payload.size()));
+                array.values.append(payload);
+            }
+            }
+        }
+        tracker.addValue(array.role, array.type, array.values.size() - previousSize);
+        return true;
+    }
+
+    void writeBinaryColumn(QDataStream& destination, SaveContext& context, int column, int rowCount)
+    {
+        QVector<ColumnArray> arrays;
+        for (int i = 0; i < rowCount && !context.tracker.isCancelled(); ++i) {
+            const QVector<QVariant>& roleValues = context.cellData(context.index(i, column, QModelIndex()));
+            for (int k = 0; k < roleValues.size(); ++k) {
+                const QVariant& roleData = roleValues.at(k);
+                if (roleData.isNull())
+                    continue; // Skip empty roles
+                const int singleRole = context.rolesToSave.at(k);
+                int arrayIndex = 0;
+                while (arrayIndex < arrays.size() && (arrays.at(arrayIndex).role != singleRole || arrays.at(arrayIndex).type != roleData.userType()))
+                    ++arrayIndex;
+                if (arrayIndex == arrays.size()) {
+                    ColumnArray array;
+                    array.role = singleRole;
+                    array.type = roleData.userType();
+                    array.present.resize(rowCount);
+                    arrays.append(array);
+                }
+                ColumnArray& array = arrays[arrayIndex];
+                if (!encodeColumnValue(context.tracker, array, roleData, destination.version()))
+                    continue; // Skip unhandled types
+                array.present.setBit(i);
+            }
+            context.tracker.cellDone();
+        }
+        destination << quint32(arrays.size());
+        for (const ColumnArray& array : arrays)
+            destination << array.role << array.type << array.present << array.sizes << array.values;
+    }
+
+    // The top level of a flat table written one column at a time, see columnarLayout
+    void writeBinaryColumns(QDataStream& destination, SaveContext& context)
+    {
+        const int rowCount = context.rowCount(QModelIndex());
+        const int colCount = context.columnCount(QModelIndex());
+        context.tracker.addCells(qint64(rowCount) * colCount);
+        destination << qint32(rowCount) << qint32(colCount);
+        for (int j = 0; j < colCount && !context.tracker.isCancelled(); ++j)
+            writeBinaryColumn(destination, context, j, rowCount);
+    }
+
+    bool isFlatTable(SaveContext& context)
+    {
+        const int rowCount = context.rowCount(QModelIndex());
+        const int colCount = context.columnCount(QModelIndex());
+        for (int i = 0; i < rowCount; ++i) {
+            for (int j = 0; j < colCount; ++j) {
+                if (context.hasChildren(context.index(i, j, QModelIndex())))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Checks the sizes of the array against its values so they can be decoded without further checks
+    bool readColumnArray(QDataStream& source, int rowCount, ColumnArray& array)
+    {
+        source >> array.role >> array.type >> array.present >> array.sizes >> array.values;
+        if (source.status() != QDataStream::Ok || array.present.size() != rowCount)
+            return false;
+        array.valuePosition = 0;
+        array.sizePosition = 0;
+        const qint64 valueCount = array.present.count(true);
+        const int valueWidth = columnValueWidth(array.type);
+        if (valueWidth > 0)
+            return array.sizes.isEmpty() && array.values.size() == valueCount * valueWidth;
+        if (array.sizes.size() != valueCount * qint64(sizeof(qint32)))
+            return false;
+        const int characterSize = array.type == QMetaType::QString ? 2 : 1;
+        qint64 valuesSize = 0;
+        for (qint64 k = 0; k < valueCount; ++k) {
+            const qint32 valueSize = qFromLittleEndian<qint32>(array.sizes.constData() + k * sizeof(qint32));
+            if (valueSize < 0)
+                return false;
+            valuesSize += qint64(valueSize) * characterSize;
+        }
+        return valuesSize == array.values.size();
+    }
+
+    // Size in bytes of the next value of the array
+    int nextColumnValueSize(ColumnArray& array)
+    {
+        const int valueWidth = columnValueWidth(array.type);
+        if (valueWidth > 0)
+            return valueWidth;
+        const qint32 valueSize = qFromLittleEndian<qint32>(array.sizes.constData() + array.sizePosition);
+        array.sizePosition += sizeof(qint32);
+        return array.type == QMetaType::QString ? valueSize * 2 : valueSize;
+    }
+
+    void skipColumnValue(ColumnArray& array)
+    {
+        array.valuePosition += nextColumnValueSize(array);
+    }
+
+    QVariant decodeColumnValue(OperationTracker& tracker, ColumnArray& array, int streamVersion)
+    {
+        const int valueSize = nextColumnValueSize(array);
+        const char* const data = array.values.constData() + array.valuePosition;
+        array.valuePosition += valueSize;
+        tracker.addValue(array.role, array.type, valueSize);
+        const ScopedTimer timer(tracker.encodingTime());
+        switch (array.type) {
+        case QMetaType::Bool: return *data != 0;
+        case QMetaType::Int: return qFromLittleEndian<qint32>(data);
+        case QMetaType::UInt: return qFromLittleEndian<quint32>(data);
+        case QMetaType::LongLong: return qFromLittleEndian<qint64>(data);
+        case QMetaType::ULongLong: return qFromLittleEndian<quint64>(data);
+        case QMetaType::Float: {
+            const quint32 bits = qFromLittleEndian<quint32>(data);
+            float number;
+            std::memcpy(&number, &bits, sizeof(number));
+            return number;
+        }
+        case QMetaType::Double: {
+            const quint64 bits = qFromLittleEndian<quint64>(data);
+            double number;
+            std::memcpy(&number, &bits, sizeof(number));
+            return number;
+        }
+        case QMetaType::QString: {
+            QString text(valueSize / 2, Qt::Uninitialized);
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+            std::memcpy(text.data(), data, valueSize);
+#else
+            for (int k = 0; k < text.size(); ++k)
+                text[k] = QChar(qFromLittleEndian<quint16>(data + 2 * k));
+#endif
+            return text;
+        }
+        default:
+            return loadBinaryVariant(array.type, QByteArray::fromRawData(data, valueSize), streamVersion);
+        }
+    }
+
+    bool readBinaryColumns(QDataStream& source, LoadContext& context)
+    {
+        qint32 rowCount, colCount;
+        source >> rowCount >> colCount;
+        if (source.status() != QDataStream::Ok || rowCount < 0 || colCount < 0)
+            return false;
+        // A flat table has no children so a subtree path leaves nothing to load
+        const bool loadsCells = !context.isOnPath();
+        if (loadsCells) {
+            const int targetRowCount = context.targetRowCount(rowCount);
+            context.ensureSize(QModelIndex(), targetRowCount, colCount);
+            context.tracker.addCells(qint64(targetRowCount) * colCount);
+        }
+        QVector<ColumnArray> arrays;
+        QMap<int, QVariant> cellData;
+        for (int j = 0; j < colCount; ++j) {
+            quint32 arrayCount;
+            source >> arrayCount;
+            if (source.status() != QDataStream::Ok)
+                return false;
+            arrays.clear();
+            for (quint32 k = 0; k < arrayCount; ++k) {
+                ColumnArray array;
+                if (!readColumnArray(source, rowCount, array))
+                    return false;
+                if (loadsCells && context.includesRole(array.role))
+                    arrays.append(array);
+            }
+            if (!loadsCells)
+                continue;
+            for (int i = 0; i < rowCount; ++i) {
+                const bool includesRow = context.includesCell(i, j);
+                for (ColumnArray& array : arrays) {
+                    if (!array.present.testBit(i))
+                        continue;
+                    if (!includesRow) {
+                        skipColumnValue(array);
+                        continue;
+                    }
+                    const QVariant roleVariant = decodeColumnValue(context.tracker, array, source.version());
+                    if (!roleVariant.isNull()) // skip unhandled types
+                        cellData.insert(array.role, roleVariant);
+                }
+                if (!includesRow)
+                    continue;
+                if (!cellData.isEmpty()) {
+                    context.setItemData(context.index(context.targetRow(i), j, QModelIndex()), cellData);
+                    cellData.clear();
+                }
+                context.tracker.cellDone();
+                if (context.tracker.isCancelled())
+                    return false;
+            }
+        }
+        context.levelLoaded(QModelIndex());
+        return true;
+    }
+
+    bool saveBinaryModel(SaveContext& context, QIODevice* destination)
+    {
+        QDataStream writer(destination);
+        // The header is always written with a fixed stream version, the values use the one recorded after it
+        writer.setVersion(QDataStream::Qt_5_0);
+        writer.writeRawData(binaryMagic, binaryMagicSize);
+        writer << qint32(1) << binaryMinorVersion << qint32(0); // Major, Minor, Micro
+        const qint32 valueStreamVersion = QDataStream().version();
+        writer << valueStreamVersion;
+        const bool columnar = context.options.columnarLayout && !context.options.deduplicateValues && !context.blobs && isFlatTable(context);
+        writer << quint32((context.options.deduplicateValues ? SharedValuesFlag : 0) | (context.blobs ? BlobsFlag : 0) | (columnar ? ColumnarFlag : 0));
+        if (context.blobs)
+            writer << context.blobFileName;
+        writer.setVersion(valueStreamVersion);
+        // Shared values must be written before their references so rows that share them can't be encoded in parallel
+        if (columnar)
+            writeBinaryColumns(writer, context);
+        else
+            writeBinaryElement(writer, context, QModelIndex(), context.canSaveInParallel());
+        if (context.tracker.isCancelled())
+            return false;
+        writeBinaryHeaderData(writer, context, Qt::Horizontal);
+        writeBinaryHeaderData(writer, context, Qt::Vertical);
+        return writer.status() == QDataStream::Ok;
+    }
+
+    // blobFileName is left empty if the document does not name its blob file
+    bool readBinaryHeader(QDataStream& reader, qint32& minorVersion, quint32& flags, QString& blobFileName)
+    {
+        reader.setVersion(QDataStream::Qt_5_0);
+        char magic[binaryMagicSize];
+        if (reader.readRawData(magic, binaryMagicSize) != binaryMagicSize || std::memcmp(magic, binaryMagic, binaryMagicSize) != 0)
+            return false;
+        qint32 majorVersion, microVersion, valueStreamVersion;
+        reader >> majorVersion >> minorVersion >> microVersion >> valueStreamVersion;
+        Q_UNUSED(microVersion)
+        flags = 0;
+        if (minorVersion >= 2)
+            reader >> flags;
+        if (minorVersion >= 3 && (flags & BlobsFlag))
+            reader >> blobFileName;
+        if (reader.status() != QDataStream::Ok || majorVersion != 1 || valueStreamVersion > QDataStream().version() || (flags & ~knownBinaryDocumentFlags))
+            return false;
+        reader.setVersion(valueStreamVersion);
+        return true;
+    }
+
+    bool loadBinaryModel(LoadContext& context, QIODevice* source)
+    {
+        QDataStream reader(source);
+        quint32 flags;
+        QString blobFileName;
+        if (!readBinaryHeader(reader, context.minorVersion, flags, blobFileName))
+            return false;
+        context.sharedValues = (flags & SharedValuesFlag) != 0;
+        context.blobReferences = (flags & BlobsFlag) != 0;
+        if (context.blobReferences)
+            context.mapBlobs(blobFileName);
+        const bool columnar = (flags & ColumnarFlag) != 0;
+        if (!(
+            (columnar ? readBinaryColumns(reader, context) : readBinaryElement(reader, context))
+            && readBinaryHeaderData(reader, context, Qt::Horizontal)
+            && readBinaryHeaderData(reader, context, Qt::Vertical)
+            )) {
+            clearModel(context.model);
+            return false;
+        }
+        return true;
+    }
+
+    const char compressedMagic[] = "QMSZ";
+    const int compressedMagicSize = 4;
+    // Size of the blocks moved between a CompressionDevice and the device it wraps
+    const int compressionChunkSize = 64 * 1024;
+
+    bool compressionAvailable(StreamCompression compression)
+    {
+        switch (compression) {
+#ifdef MODELSERIALISATION_ZLIB
+        case ZlibCompression: return true;
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+        case ZstdCompression: return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    // Compresses what is written to it into another device or decompresses what is read from it.
+    // The wrapped device must be open, it is not closed by this one
+    class CompressionDevice : public QIODevice
+    {
+        Q_DISABLE_COPY(CompressionDevice)
+    public:
+        CompressionDevice(QIODevice* device, StreamCompression compression, int level = -1)
+            : m_device(device)
+            , m_compression(compression)
+            , m_level(level)
+            , m_inputPosition(0)
+            , m_streamEnd(false)
+            , m_started(false)
+#ifdef MODELSERIALISATION_ZSTD
+            , m_zstdCompressor(nullptr)
+            , m_zstdDecompressor(nullptr)
+#endif
+        {
+#ifdef MODELSERIALISATION_ZLIB
+            std::memset(&m_zlibStream, 0, sizeof(m_zlibStream));
+#endif
+        }
+        ~CompressionDevice()
+        {
+            close();
+        }
+        bool isSequential() const override
+        {
+            return true;
+        }
+        bool atEnd() const override
+        {
+            return m_streamEnd && QIODevice::bytesAvailable() == 0;
+        }
+        bool open(OpenMode mode) override
+        {
+            // The stream only goes in one direction
+            if ((mode & ReadWrite) == ReadWrite || (mode & ReadWrite) == 0 || isOpen())
+                return false;
+            const bool compressing = mode & WriteOnly;
+            Q_UNUSED(compressing) // When built without zlib and zstd
+            switch (m_compression) {
+#ifdef MODELSERIALISATION_ZLIB
+            case ZlibCompression:
+                m_started = (compressing ? deflateInit(&m_zlibStream, qBound(-1, m_level, 9)) : inflateInit(&m_zlibStream)) == Z_OK;
+                break;
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+            case ZstdCompression:
+                if (compressing) {
+                    m_zstdCompressor = ZSTD_createCCtx();
+                    m_started = m_zstdCompressor
+                        && !ZSTD_isError(ZSTD_CCtx_setParameter(m_zstdCompressor, ZSTD_c_compressionLevel, m_level < 0 ? ZSTD_CLEVEL_DEFAULT : m_level));
+                }
+                else {
+                    m_zstdDecompressor = ZSTD_createDCtx();
+                    m_started = m_zstdDecompressor != nullptr;
+                }
+                break;
+#endif
+            default:
+                m_started = false;
+            }
+            if (!m_started) {
+                endStream();
+                return false;
+            }
+            m_streamEnd = false;
+            return QIODevice::open(mode);
+        }
+        // Writes the end of the compressed stream, returns false if the stream could not be completed
+        bool finish()
+        {
+            if (!isOpen() || !(openMode() & WriteOnly) || m_streamEnd)
+                return m_streamEnd;
+            m_streamEnd = compress(nullptr, 0, true);
+            return m_streamEnd;
+        }
+        void close() override
+        {
+            if (!isOpen())
+                return;
+            finish();
+            endStream();
+            QIODevice::close();
+        }
+    protected:
+        qint64 writeData(const char* data, qint64 maxSize) override
+        {
+            return compress(data, maxSize, false) ? maxSize : -1;
+        }
+        qint64 readData(char* data, qint64 maxSize) override
+        {
+            qint64 produced = 0;
+            while (produced < maxSize && !m_streamEnd) {
+                if (m_inputPosition >= m_input.size()) {
+                    m_input = m_device->read(compressionChunkSize);
+                    m_inputPosition = 0;
+                    if (m_input.isEmpty())
+                        return produced > 0 ? produced : -1; // The stream was cut short
+                }
+                switch (m_compression) {
+#ifdef MODELSERIALISATION_ZLIB
+                case ZlibCompression: {
+                    m_zlibStream.next_in = reinterpret_cast<Bytef*>(m_input.data() + m_inputPosition);
+                    m_zlibStream.avail_in = uInt(m_input.size() - m_inputPosition);
+                    const uInt outputSize = uInt(qMin<qint64>(maxSize - produced, std::numeric_limits<int>::max()));
+                    m_zlibStream.next_out = reinterpret_cast<Bytef*>(data + produced);
+                    m_zlibStream.avail_out = outputSize;
+                    const int status = inflate(&m_zlibStream, Z_NO_FLUSH);
+                    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                        return -1;
+                    m_inputPosition = m_input.size() - int(m_zlibStream.avail_in);
+                    produced += outputSize - m_zlibStream.avail_out;
+                    m_streamEnd = status == Z_STREAM_END;
+                    break;
+                }
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+                case ZstdCompression: {
+                    ZSTD_inBuffer input = { m_input.constData(), size_t(m_input.size()), size_t(m_inputPosition) };
+                    ZSTD_outBuffer output = { data + produced, size_t(maxSize - produced), 0 };
+                    const size_t status = ZSTD_decompressStream(m_zstdDecompressor, &output, &input);
+                    if (ZSTD_isError(status))
+                        return -1;
+                    m_inputPosition = int(input.pos);
+                    produced += qint64(output.pos);
+                    m_streamEnd = status == 0; // The frame is complete
+                    break;
+                }
+#endif
+                default:
+                    return -1;
+                }
+            }
+            return produced;
+        }
+    private:
+        // Passes data to the compressor and writes whatever it produces to the wrapped device
+        bool compress(const char* data, qint64 size, bool lastBlock)
+        {
+            m_output.resize(compressionChunkSize);
+            switch (m_compression) {
+#ifdef MODELSERIALISATION_ZLIB
+            case ZlibCompression: {
+                qint64 remaining = size;
+                do {
+                    const uInt inputSize = uInt(qMin<qint64>(remaining, std::numeric_limits<int>::max()));
+                    m_zlibStream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + (size - remaining)));
+                    m_zlibStream.avail_in = inputSize;
+                    remaining -= inputSize;
+                    const int flush = lastBlock && remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+                    int status;
+                    do {
+                        m_zlibStream.next_out = reinterpret_cast<Bytef*>(m_output.data());
+                        m_zlibStream.avail_out = compressionChunkSize;
+                        status = deflate(&m_zlibStream, flush);
+                        if (status == Z_STREAM_ERROR)
+                            return false;
+                        if (!writeOutput(compressionChunkSize - int(m_zlibStream.avail_out)))
+                            return false;
+                    } while (m_zlibStream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+                } while (remaining > 0);
+                return true;
+            }
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+            case ZstdCompression: {
+                ZSTD_inBuffer input = { data, size_t(size), 0 };
+                size_t remaining;
+                do {
+                    ZSTD_outBuffer output = { m_output.data(), size_t(m_output.size()), 0 };
+                    remaining = ZSTD_compressStream2(m_zstdCompressor, &output, &input, lastBlock ? ZSTD_e_end : ZSTD_e_continue);
+                    if (ZSTD_isError(remaining))
+                        return false;
+                    if (!writeOutput(int(output.pos)))
+                        return false;
+                } while (lastBlock ? remaining != 0 : input.pos < input.size);
+                return true;
+            }
+#endif
+            default:
+                return false;
+            }
+        }
+        bool writeOutput(int size)
+        {
+            return size == 0 || m_device->write(m_output.constData(), size) == size;
+        }
+        void endStream()
+        {
+#ifdef MODELSERIALISATION_ZLIB
+            if (m_started && m_compression == ZlibCompression) {
+                if (openMode() & WriteOnly)
+                    deflateEnd(&m_zlibStream);
+                else
+                    inflateEnd(&m_zlibStream);
+            }
+#endif
+            m_started = false;
+#ifdef MODELSERIALISATION_ZSTD
+            ZSTD_freeCCtx(m_zstdCompressor);
+            m_zstdCompressor = nullptr;
+            ZSTD_freeDCtx(m_zstdDecompressor);
+            m_zstdDecompressor = nullptr;
+#endif
+        }
+        QIODevice* m_device;
+        StreamCompression m_compression;
+        int m_level;
+        QByteArray m_input;
+        int m_inputPosition;
+        QByteArray m_output;
+        bool m_streamEnd;
+        bool m_started;
+#ifdef MODELSERIALISATION_ZLIB
+        z_stream m_zlibStream;
+#endif
+#ifdef MODELSERIALISATION_ZSTD
+        ZSTD_CCtx* m_zstdCompressor;
+        ZSTD_DCtx* m_zstdDecompressor;
+#endif
+    };
+
+    // Compressed documents start with the magic, the version of the container and the compression of the rest of the stream
+    bool writeCompressionHeader(QIODevice* destination, StreamCompression compression)
+    {
+        QDataStream writer(destination);
+        writer.setVersion(QDataStream::Qt_5_0);
+        writer.writeRawData(compressedMagic, compressedMagicSize);
+        writer << qint32(1) << qint32(compression);
+        return writer.status() == QDataStream::Ok;
+    }
+
+    // Sets compression to NoCompression if the source is not a compressed document
+    bool readCompressionHeader(QIODevice* source, StreamCompression& compression)
+    {
+        compression = NoCompression;
+        if (source->peek(compressedMagicSize) != QByteArray::fromRawData(compressedMagic, compressedMagicSize))
+            return true;
+        QDataStream reader(source);
+        reader.setVersion(QDataStream::Qt_5_0);
+        reader.skipRawData(compressedMagicSize);
+        qint32 containerVersion, compressionId;
+        reader >> containerVersion >> compressionId;
+        if (reader.status() != QDataStream::Ok || containerVersion != 1)
+            return false;
+        compression = static_cast<StreamCompression>(compressionId);
+        return compressionAvailable(compression);
+    }
+
+    QList<int> modelDefaultRoles()
+    {
+        return QList<int>()
+            << Qt::DecorationRole
             << Qt::EditRole
             << Qt::ToolTipRole
             << Qt::StatusTipRole
@@ -247,182 +3048,1628 @@ namespace ModelSerialisation {
             ;
     }
 
-    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination, const QList<int>& rolesToSave)
+    void writeHeaderData(QXmlStreamWriter& destination, SaveContext& context, Qt::Orientation orientation)
+    {
+        // Header data is saved only for the number of rows and columns in the root table
+        const int sectionCount = orientation == Qt::Horizontal ? context.columnCount(QModelIndex()) : context.rowCount(QModelIndex());
+        for (int i = 0; i < sectionCount; ++i) {
+            foreach(int singleRole, context.rolesToSave)
+            {
+                const QVariant roleData = context.headerData(i, orientation, singleRole);
+                if (roleData.isNull())
+                    continue;
+                bool isPayload;
+                const QString roleString = encodeVariant(context.tracker, singleRole, roleData, context.options.payloadEncoding, context.compressPayloads(), &isPayload);
+                if (roleString.isEmpty())
+                    continue; // Skip unhandled types
+                destination.writeStartElement(QStringLiteral("HeaderDataPoint"));
+                destination.writeAttribute(QStringLiteral("Section"), QString::number(i));
+                destination.writeAttribute(QStringLiteral("Role"), QString::number(singleRole));
+                destination.writeAttribute(QStringLiteral("Type"), QString::number(roleData.type()));
+                if (isPayload && context.options.payloadEncoding == Base64Payload)
+                    destination.writeAttribute(QStringLiteral("Encoding"), QStringLiteral("Base64"));
+                destination.writeCharacters(roleString);
+                destination.writeEndElement(); // HeaderDataPoint
+            }
+        }
+    }
+
+    bool saveXmlModel(SaveContext& context, QIODevice* destination)
     {
-        if (!destination->isWritable())
-            return false;
         QXmlStreamWriter writer(destination);
         writer.writeStartDocument();
         writer.writeStartElement(QStringLiteral("ItemModel"));
         writer.writeStartElement(QStringLiteral("Version")); // Use these to implement versioning of the serialised values
-        writer.writeTextElement(QStringLiteral("Major"), QString::number(1));
-        writer.writeTextElement(QStringLiteral("Minor"), QString::number(0));
-        writer.writeTextElement(QStringLiteral("Micro"), QString::number(0));
+        writer.writeTextElement(QStringLiteral("Major"), QString::number(context.options.xmlVersion));
+        // Documents from version x.1 can share values, documents from version x.2 can also store values in the blob file
+        writer.writeTextElement(QStringLiteral("Minor"), QString::number(context.blobs ? 2 : (context.options.deduplicateValues ? 1 : 0)));
+        // Documents from version x.y.1 don't compress their payloads one by one, so the document still loads once taken out of its container
+        writer.writeTextElement(QStringLiteral("Micro"), QString::number(context.compressPayloads() ? 0 : 1));
         writer.writeEndElement(); // Version
-        writeElement(writer, model, rolesToSave);
+        if (context.blobs)
+            writer.writeTextElement(QStringLiteral("BlobFile"), context.blobFileName);
+        const QList<int> codecTypes = userCodecTypes();
+        if (!codecTypes.isEmpty()) {
+            // The values of these types only carry the id of the type, which changes from one run to the next
+            writer.writeStartElement(QStringLiteral("CodecTypes"));
+            for (int codecType : codecTypes) {
+                writer.writeStartElement(QStringLiteral("CodecType"));
+                writer.writeAttribute(QStringLiteral("Id"), QString::number(codecType));
+                writer.writeAttribute(QStringLiteral("Name"), QLatin1String(metaTypeName(codecType)));
+                writer.writeEndElement(); // CodecType
+            }
+            writer.writeEndElement(); // CodecTypes
+        }
+        writeElement(writer, context);
+        if (context.tracker.isCancelled())
+            return false;
         writer.writeStartElement(QStringLiteral("HeaderData"));
-        // Header data is saved only for the number of rows and columns in the root table
         writer.writeStartElement(QStringLiteral("Horizontal"));
-        for (int i = 0; i < model->columnCount(); ++i) {
-            foreach(int singleRole, rolesToSave)
+        writeHeaderData(writer, context, Qt::Horizontal);
+        writer.writeEndElement(); // Horizontal
+        writer.writeStartElement(QStringLiteral("Vertical"));
+        writeHeaderData(writer, context, Qt::Vertical);
+        writer.writeEndElement(); // Vertical
+        writer.writeEndElement(); // HeaderData
+        writer.writeEndElement(); // ItemModel
+        writer.writeEndDocument();
+        return !context.writeFailed && !writer.hasError();
+    }
+
+    // Copy of a tree of cells, used to hand the data of a model from one thread to another.
+    // It is never attached to views so its changes are not notified
+    class DetachedModel : public QAbstractItemModel
+    {
+        Q_DISABLE_COPY(DetachedModel)
+    public:
+        DetachedModel()
+            : m_root(new Table(nullptr, 0))
+        {}
+        ~DetachedModel()
+        {
+            delete m_root;
+        }
+        const QVector<QMap<int, QVariant> >& headerValues(Qt::Orientation orientation) const
+        {
+            return orientation == Qt::Horizontal ? m_horizontalHeader : m_verticalHeader;
+        }
+        QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex()) const Q_DECL_OVERRIDE
+        {
+            Table* const table = tableAt(parent);
+            if (!table || row < 0 || column < 0 || row >= table->rowCount || column >= table->colCount)
+                return QModelIndex();
+            return createIndex(row, column, table);
+        }
+        QModelIndex parent(const QModelIndex& child) const Q_DECL_OVERRIDE
+        {
+            if (!child.isValid())
+                return QModelIndex();
+            const Table* const table = static_cast<const Table*>(child.internalPointer());
+            if (!table->parentTable)
+                return QModelIndex();
+            const int parentColCount = table->parentTable->colCount;
+            return createIndex(table->parentCell / parentColCount, table->parentCell % parentColCount, table->parentTable);
+        }
+        int rowCount(const QModelIndex& parent = QModelIndex()) const Q_DECL_OVERRIDE
+        {
+            const Table* const table = tableAt(parent);
+            return table ? table->rowCount : 0;
+        }
+        int columnCount(const QModelIndex& parent = QModelIndex()) const Q_DECL_OVERRIDE
+        {
+            const Table* const table = tableAt(parent);
+            return table ? table->colCount : 0;
+        }
+        QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const Q_DECL_OVERRIDE
+        {
+            const Cell* const cell = cellAt(index);
+            return cell ? cell->values.value(role) : QVariant();
+        }
+        QMap<int, QVariant> itemData(const QModelIndex& index) const Q_DECL_OVERRIDE
+        {
+            const Cell* const cell = cellAt(index);
+            return cell ? cell->values : QMap<int, QVariant>();
+        }
+        bool setData(const QModelIndex& index, const QVariant& value, int role = Qt::EditRole) Q_DECL_OVERRIDE
+        {
+            Cell* const cell = cellAt(index);
+            if (!cell)
+                return false;
+            if (value.isNull())
+                cell->values.remove(role);
+            else
+                cell->values.insert(role, value);
+            return true;
+        }
+        bool setItemData(const QModelIndex& index, const QMap<int, QVariant>& roles) Q_DECL_OVERRIDE
+        {
+            Cell* const cell = cellAt(index);
+            if (!cell)
+                return false;
+            if (cell->values.isEmpty()) {
+                cell->values = roles; // Shares the map instead of copying it
+                return true;
+            }
+            for (QMap<int, QVariant>::const_iterator i = roles.constBegin(); i != roles.constEnd(); ++i)
+                setData(index, i.value(), i.key());
+            return true;
+        }
+        QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const Q_DECL_OVERRIDE
+        {
+            const QVector<QMap<int, QVariant> >& header = headerValues(orientation);
+            if (section < 0 || section >= header.size())
+                return QVariant();
+            return header.at(section).value(role);
+        }
+        bool setHeaderData(int section, Qt::Orientation orientation, const QVariant& value, int role = Qt::EditRole) Q_DECL_OVERRIDE
+        {
+            QVector<QMap<int, QVariant> >& header = orientation == Qt::Horizontal ? m_horizontalHeader : m_verticalHeader;
+            if (section < 0 || section >= header.size())
+                return false;
+            if (value.isNull())
+                header[section].remove(role);
+            else
+                header[section].insert(role, value);
+            return true;
+        }
+        bool insertRows(int row, int count, const QModelIndex& parent = QModelIndex()) Q_DECL_OVERRIDE
+        {
+            Table* const table = tableAt(parent, true);
+            if (!table || row < 0 || count < 0 || row > table->rowCount)
+                return false;
+            table->cells.insert(row * table->colCount, count * table->colCount, Cell());
+            table->rowCount += count;
+            updateChildren(table);
+            if (table == m_root)
+                m_verticalHeader.insert(row, count, QMap<int, QVariant>());
+            return true;
+        }
+        bool insertColumns(int column, int count, const QModelIndex& parent = QModelIndex()) Q_DECL_OVERRIDE
+        {
+            Table* const table = tableAt(parent, true);
+            if (!table || column < 0 || count < 0 || column > table->colCount)
+                return false;
+            QVector<Cell> cells;
+            cells.reserve(table->rowCount * (table->colCount + count));
+            for (int i = 0; i < table->rowCount; ++i) {
+                for (int j = 0; j < table->colCount + count; ++j) {
+                    if (j < column)
+                        cells.append(table->cells.at(i * table->colCount + j));
+                    else if (j < column + count)
+                        cells.append(Cell());
+                    else
+                        cells.append(table->cells.at(i * table->colCount + j - count));
+                }
+            }
+            table->cells.swap(cells);
+            table->colCount += count;
+            updateChildren(table);
+            if (table == m_root)
+                m_horizontalHeader.insert(column, count, QMap<int, QVariant>());
+            return true;
+        }
+        bool removeRows(int row, int count, const QModelIndex& parent = QModelIndex()) Q_DECL_OVERRIDE
+        {
+            Table* const table = tableAt(parent);
+            if (!table || row < 0 || count < 0 || row + count > table->rowCount)
+                return false;
+            for (int k = row * table->colCount; k < (row + count) * table->colCount; ++k)
+                delete table->cells.at(k).children;
+            table->cells.remove(row * table->colCount, count * table->colCount);
+            table->rowCount -= count;
+            updateChildren(table);
+            if (table == m_root)
+                m_verticalHeader.remove(row, count);
+            return true;
+        }
+        bool removeColumns(int column, int count, const QModelIndex& parent = QModelIndex()) Q_DECL_OVERRIDE
+        {
+            Table* const table = tableAt(parent);
+            if (!table || column < 0 || count < 0 || column + count > table->colCount)
+                return false;
+            QVector<Cell> cells;
+            cells.reserve(table->rowCount * (table->colCount - count));
+            for (int i = 0; i < table->rowCount; ++i) {
+                for (int j = 0; j < table->colCount; ++j) {
+                    const Cell& cell = table->cells.at(i * table->colCount + j);
+                    if (j < column || j >= column + count)
+                        cells.append(cell);
+                    else
+                        delete cell.children;
+                }
+            }
+            table->cells.swap(cells);
+            table->colCount -= count;
+            updateChildren(table);
+            if (table == m_root)
+                m_horizontalHeader.remove(column, count);
+            return true;
+        }
+    private:
+        struct Table;
+        struct Cell
+        {
+            Cell() : children(nullptr) {}
+            QMap<int, QVariant> values;
+            Table* children; // Owned by the table holding the cell
+        };
+        // The cells of a level in row major order
+        struct Table
+        {
+            Table(Table* parentTable, int parentCell)
+                : parentTable(parentTable), parentCell(parentCell), rowCount(0), colCount(0)
+            {}
+            ~Table()
             {
-                const QVariant roleData = model->headerData(i, Qt::Horizontal, singleRole);
-                if (roleData.isNull())
-                    continue;
-                const QString roleString = saveVariant(roleData);
-                if (roleString.isEmpty())
-                    continue; // Skip unhandled types
-                writer.writeStartElement(QStringLiteral("HeaderDataPoint"));
-                writer.writeAttribute(QStringLiteral("Section"), QString::number(i));
-                writer.writeAttribute(QStringLiteral("Role"), QString::number(singleRole));
-                writer.writeAttribute(QStringLiteral("Type"), QString::number(roleData.type()));
-                writer.writeCharacters(roleString);
-                writer.writeEndElement(); // HeaderDataPoint
+                for (const Cell& cell : cells)
+                    delete cell.children;
+            }
+            Table* parentTable;
+            int parentCell; // Position of the parent cell in the cells of parentTable
+            int rowCount;
+            int colCount;
+            QVector<Cell> cells;
+        private:
+            Q_DISABLE_COPY(Table)
+        };
+        Cell* cellAt(const QModelIndex& index) const
+        {
+            if (!index.isValid() || index.model() != this)
+                return nullptr;
+            Table* const table = static_cast<Table*>(index.internalPointer());
+            if (index.row() >= table->rowCount || index.column() >= table->colCount)
+                return nullptr;
+            return &table->cells[index.row() * table->colCount + index.column()];
+        }
+        Table* tableAt(const QModelIndex& parent, bool create = false) const
+        {
+            if (!parent.isValid())
+                return m_root;
+            Cell* const cell = cellAt(parent);
+            if (!cell)
+                return nullptr;
+            if (!cell->children && create) {
+                Table* const parentTable = static_cast<Table*>(parent.internalPointer());
+                cell->children = new Table(parentTable, parent.row() * parentTable->colCount + parent.column());
+            }
+            return cell->children;
+        }
+        // Moving cells changes where the subtrees hang from
+        static void updateChildren(Table* table)
+        {
+            for (int k = 0; k < table->cells.size(); ++k) {
+                if (table->cells.at(k).children)
+                    table->cells.at(k).children->parentCell = k;
+            }
+        }
+        Table* m_root;
+        QVector<QMap<int, QVariant> > m_horizontalHeader;
+        QVector<QMap<int, QVariant> > m_verticalHeader;
+    };
+
+    // Copies the roles to save of a cell, cellValues is only a buffer reused between cells
+    void copyCellData(SaveContext& context, DetachedModel& snapshot, const QModelIndex& sourceIndex, const QModelIndex& snapshotIndex, QMap<int, QVariant>& cellValues)
+    {
+        const QVector<QVariant>& roleValues = context.cellData(sourceIndex);
+        cellValues.clear();
+        for (int k = 0; k < roleValues.size(); ++k) {
+            if (!roleValues.at(k).isNull())
+                cellValues.insert(context.rolesToSave.at(k), roleValues.at(k));
+        }
+        if (!cellValues.isEmpty())
+            snapshot.setItemData(snapshotIndex, cellValues);
+    }
+
+    void copyLevel(SaveContext& context, DetachedModel& snapshot, const QModelIndex& sourceParent, const QModelIndex& snapshotParent)
+    {
+        const int rowCount = context.rowCount(sourceParent);
+        const int colCount = context.columnCount(sourceParent);
+        snapshot.insertRows(0, rowCount, snapshotParent);
+        snapshot.insertColumns(0, colCount, snapshotParent);
+        QMap<int, QVariant> cellValues;
+        for (int i = 0; i < rowCount; ++i) {
+            for (int j = 0; j < colCount; ++j) {
+                const QModelIndex sourceIndex = context.index(i, j, sourceParent);
+                const QModelIndex snapshotIndex = snapshot.index(i, j, snapshotParent);
+                copyCellData(context, snapshot, sourceIndex, snapshotIndex, cellValues);
+                if (context.hasChildren(sourceIndex))
+                    copyLevel(context, snapshot, sourceIndex, snapshotIndex);
+            }
+        }
+    }
+
+    void copyHeaderData(SaveContext& context, DetachedModel& snapshot, Qt::Orientation orientation)
+    {
+        const int sectionCount = orientation == Qt::Horizontal ? context.columnCount(QModelIndex()) : context.rowCount(QModelIndex());
+        for (int i = 0; i < sectionCount; ++i) {
+            foreach(int singleRole, context.rolesToSave)
+                snapshot.setHeaderData(i, orientation, context.headerData(i, orientation, singleRole), singleRole);
+        }
+    }
+
+    void applyHeaderData(LoadContext& context, const QVector<QMap<int, QVariant> >& header, Qt::Orientation orientation)
+    {
+        for (int i = 0; i < header.size(); ++i) {
+            for (QMap<int, QVariant>::const_iterator j = header.at(i).constBegin(); j != header.at(i).constEnd(); ++j)
+                context.setHeaderData(i, orientation, j.value(), j.key());
+        }
+    }
+
+    QAbstractItemModel* ModelAdapter::createCells(const QAbstractItemModel* model) const
+    {
+        Q_UNUSED(model)
+        return new DetachedModel;
+    }
+
+    // Reads the document straight into the items of a QStandardItemModel nothing is attached to, then moves its top level into the model.
+    // Every item exists once during the load and empty cells get no item, like the cells QStandardItemModel never touched
+    class StandardItemModelAdapter : public ModelAdapter
+    {
+    public:
+        bool handles(const QAbstractItemModel* model) const Q_DECL_OVERRIDE
+        {
+            return isStandardItemModel(model);
+        }
+        QAbstractItemModel* createCells(const QAbstractItemModel* model) const Q_DECL_OVERRIDE
+        {
+            QStandardItemModel* const cells = new QStandardItemModel;
+            // The items end up in the model so they must be the ones it would create
+            if (const QStandardItem* const prototype = static_cast<const QStandardItemModel*>(model)->itemPrototype())
+                cells->setItemPrototype(prototype->clone());
+            return cells;
+        }
+        bool setContent(QAbstractItemModel* model, QAbstractItemModel* cells) const Q_DECL_OVERRIDE
+        {
+            QStandardItemModel* const standardModel = static_cast<QStandardItemModel*>(model);
+            QStandardItemModel* const items = static_cast<QStandardItemModel*>(cells); // Made by createCells
+            const int rowCount = items->rowCount();
+            const int colCount = items->columnCount();
+            standardModel->setColumnCount(colCount);
+            standardModel->setRowCount(rowCount);
+            if (rowCount == 0 || colCount == 0)
+                return true;
+            {
+                // setChild would notify every item on its own. The cells the items go to are empty and have no children yet,
+                // so their arrival is a change of the data of the top level
+                const QSignalBlocker modelBlocker(standardModel);
+                const QSignalBlocker itemsBlocker(items);
+                for (int i = 0; i < rowCount; ++i) {
+                    for (int j = 0; j < colCount; ++j) {
+                        if (QStandardItem* const item = items->takeItem(i, j))
+                            standardModel->setItem(i, j, item);
+                    }
+                }
+            }
+            emit standardModel->dataChanged(standardModel->index(0, 0), standardModel->index(rowCount - 1, colCount - 1));
+            return true;
+        }
+    };
+
+    // Adapters registered later come first, the QStandardItemModel one is always last
+    QList<ModelAdapter*>& modelAdapters()
+    {
+        static StandardItemModelAdapter standardItemModelAdapter;
+        static QList<ModelAdapter*> adapters = QList<ModelAdapter*>() << &standardItemModelAdapter;
+        return adapters;
+    }
+
+    const ModelAdapter* modelAdapter(const QAbstractItemModel* model)
+    {
+        foreach(const ModelAdapter* adapter, modelAdapters())
+        {
+            if (adapter->handles(model))
+                return adapter;
+        }
+        return nullptr;
+    }
+
+    void registerModelAdapter(ModelAdapter* adapter)
+    {
+        if (adapter && !modelAdapters().contains(adapter))
+            modelAdapters().prepend(adapter);
+    }
+
+    void unregisterModelAdapter(ModelAdapter* adapter)
+    {
+        modelAdapters().removeAll(adapter);
+    }
+
+    bool saveDocument(SaveContext& context, QIODevice* destination)
+    {
+        switch (context.options.format) {
+        case XmlFormat: return saveXmlModel(context, destination);
+        case BinaryFormat: return saveBinaryModel(context, destination);
+        default:
+            return false;
+        }
+    }
+
+    const QLatin1String blobSuffix(".blobs");
+
+    // Every save names a new blob file after the document followed by a unique id, so it never replaces the file the current document refers to
+    QString newBlobFileName(const QString& documentPath)
+    {
+        return QFileInfo(documentPath).fileName() + QLatin1Char('.') + QString::fromLatin1(QUuid::createUuid().toRfc4122().toHex()) + blobSuffix;
+    }
+
+    // Removes the blob files written for the document except the one it refers to, currentBlobFile is empty if it has none
+    void removeStaleBlobFiles(const QString& documentPath, const QString& currentBlobFile)
+    {
+        const QFileInfo documentInfo(documentPath);
+        const QString prefix = documentInfo.fileName() + QLatin1Char('.');
+        const int idSize = 32; // Hex digits of a uuid
+        QDir directory = documentInfo.absoluteDir();
+        const QStringList candidates = directory.entryList(QStringList(prefix + QLatin1Char('*') + blobSuffix), QDir::Files | QDir::Hidden);
+        foreach(const QString& candidate, candidates)
+        {
+            if (candidate == currentBlobFile || candidate.size() != prefix.size() + idSize + blobSuffix.size())
+                continue;
+            // Only names made by newBlobFileName, other documents can share the prefix
+            bool isBlobFile = true;
+            for (int i = prefix.size(); isBlobFile && i < prefix.size() + idSize; ++i) {
+                const ushort digit = candidate.at(i).unicode();
+                isBlobFile = digit < 128 && hexValues[digit] >= 0;
+            }
+            if (isBlobFile)
+                directory.remove(candidate);
+        }
+        // Documents of version x.2 that don't name their blob file use this one
+        QFile::remove(documentPath + blobSuffix);
+    }
+
+    // blobs receives the values of at least blobThreshold bytes, if null every value is written to the destination.
+    // blobFileName is the name of the blob file the document records
+    bool saveToDevice(const QAbstractItemModel* const model, QIODevice* destination, const QList<int>& rolesToSave, const SaveOptions& options, QIODevice* blobs, const QString& blobFileName)
+    {
+        if (!destination->isWritable())
+            return false;
+        SaveContext context(model, rolesToSave, options, OperationTracker(options.observer, destination));
+        context.blobs = blobs;
+        context.blobFileName = blobFileName;
+        bool result;
+        if (options.compression == NoCompression) {
+            result = saveDocument(context, destination);
+        }
+        else {
+            // The tracker keeps watching the destination so the statistics report the compressed size
+            CompressionDevice compressor(destination, options.compression, options.compressionLevel);
+            result = compressionAvailable(options.compression)
+                && writeCompressionHeader(destination, options.compression)
+                && compressor.open(QIODevice::WriteOnly)
+                && saveDocument(context, &compressor)
+                && compressor.finish();
+        }
+        context.tracker.finish();
+        return result;
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination, const QList<int>& rolesToSave, const SaveOptions& options)
+    {
+        return saveToDevice(model, destination, rolesToSave, options, nullptr, QString());
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination, const QList<int>& rolesToSave)
+    {
+        return saveModel(model, destination, rolesToSave, SaveOptions());
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave, const SaveOptions& options)
+    {
+        QSaveFile destinationFile(destination);
+        if (!destinationFile.open(QIODevice::WriteOnly))
+            return false;
+        if (options.blobThreshold <= 0) {
+            if (!saveModel(model, &destinationFile, rolesToSave, options) || !destinationFile.commit())
+                return false;
+            removeStaleBlobFiles(destination, QString());
+            return true;
+        }
+        // The document names its blob file. The new one is in place before the document is replaced
+        // and the old one is only removed afterwards, so whichever document is on disk finds its values
+        const QString blobFileName = newBlobFileName(destination);
+        QSaveFile blobFile(siblingPath(destination, blobFileName));
+        if (!blobFile.open(QIODevice::WriteOnly))
+            return false;
+        if (!saveToDevice(model, &destinationFile, rolesToSave, options, &blobFile, blobFileName) || !blobFile.commit())
+            return false;
+        if (!destinationFile.commit()) {
+            QFile::remove(blobFile.fileName());
+            return false;
+        }
+        removeStaleBlobFiles(destination, blobFileName);
+        return true;
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave)
+    {
+        return saveModel(model, destination, rolesToSave, SaveOptions());
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, const QString& destination)
+    {
+        return saveModel(model, destination, modelDefaultRoles());
+    }
+
+    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination)
+    {
+        return saveModel(model, destination, modelDefaultRoles());
+    }
+
+    bool loadXmlModel(LoadContext& context, QIODevice* source)
+    {
+        // Use these to implement versioning of the serialised values
+        int majorVersion = -1;
+        int minorVersion = -1;
+        int microVersion = -1;
+        QXmlStreamReader reader(source);
+        bool headerDataStarted = false;
+        bool hHeaderDataStarted = false;
+        bool vHeaderDataStarted = false;
+        bool versionStarted = false;
+        while (!reader.atEnd() && !reader.hasError()) {
+            reader.readNext();
+            if (reader.isStartElement()) {
+                if (reader.name() == versionName) {
+                    versionStarted = true;
+                }
+                else if (versionStarted && reader.name() == majorName) {
+                    if (!readXmlText(reader, context.textBuffer))
+                        return false;
+                    majorVersion = decimalValue<int>(stringView(context.textBuffer));
+                    if (majorVersion > XmlVersion2)
+                        return false;
+                    context.xmlVersion = majorVersion;
+                }
+                else if (versionStarted && reader.name() == minorName) {
+                    if (!readXmlText(reader, context.textBuffer))
+                        return false;
+                    minorVersion = decimalValue<int>(stringView(context.textBuffer));
+                    context.sharedValues = minorVersion >= 1; // Documents from version x.1 may share values
+                }
+                else if (versionStarted && reader.name() == microName) {
+                    if (!readXmlText(reader, context.textBuffer))
+                        return false;
+                    microVersion = decimalValue<int>(stringView(context.textBuffer));
+                    if (microVersion >= 1) // Older documents in a compressed container only rely on the container
+                        context.compressedPayloads = false;
+                }
+                else if (reader.name() == blobFileName) {
+                    if (!readXmlText(reader, context.textBuffer))
+                        return false;
+                    context.mapBlobs(context.textBuffer);
+                }
+                else if (reader.name() == codecTypeName) {
+                    const QXmlStreamAttributes codecTypeAttributes = reader.attributes();
+                    const int documentType = decimalValue<int>(codecTypeAttributes.value(idName));
+                    if (documentType >= QMetaType::User)
+                        context.codecTypes.insert(documentType, metaTypeId(codecTypeAttributes.value(nameName).toLatin1()));
+                }
+                else if (reader.name() == elementName) {
+                    if (minorVersion >= 2 && !context.blobFile)
+                        context.mapBlobs(QString());
+                    const bool elementRead = context.xmlVersion == XmlVersion2 ? readCompactElement(reader, context) : readElement(reader, context);
+                    if (!elementRead) {
+                        clearModel(context.model);
+                        return false;
+                    }
+                }
+                else if (reader.name() == headerDataName) {
+                    headerDataStarted = true;
+                }
+                else if (reader.name() == verticalName && headerDataStarted) {
+                    if (hHeaderDataStarted)
+                        return false;
+                    vHeaderDataStarted = true;
+                }
+                else if (reader.name() == horizontalName && headerDataStarted) {
+                    if (vHeaderDataStarted)
+                        return false;
+                    hHeaderDataStarted = true;
+                }
+                else if (reader.name() == headerDataPointName && headerDataStarted) {
+                    if (!(vHeaderDataStarted || hHeaderDataStarted))
+                        return false;
+                    const QXmlStreamAttributes headDataAttribute = reader.attributes();
+                    if (!(
+                        headDataAttribute.hasAttribute(sectionName)
+                        && headDataAttribute.hasAttribute(roleName)
+                        && headDataAttribute.hasAttribute(typeName)
+                        ))
+                        return false;
+                    const int headerSection = decimalValue<int>(headDataAttribute.value(sectionName));
+                    const int headerRole = decimalValue<int>(headDataAttribute.value(roleName));
+                    const int headerType = context.currentType(decimalValue<int>(headDataAttribute.value(typeName)));
+                    const Qt::Orientation headerOrientation = vHeaderDataStarted ? Qt::Vertical : Qt::Horizontal;
+                    const int targetSection = context.targetSection(headerSection, headerOrientation, headerRole);
+                    if (targetSection < 0) {
+                        reader.skipCurrentElement();
+                        continue;
+                    }
+                    const PayloadEncoding headerEncoding = payloadEncoding(headDataAttribute);
+                    if (!readXmlText(reader, context.textBuffer))
+                        return false;
+                    const QVariant roleVariant = decodeVariant(context.tracker, headerRole, headerType, stringView(context.textBuffer), headerEncoding, context.compressedPayloads);
+                    if (!roleVariant.isNull()) // skip unhandled types
+                        context.setHeaderData(targetSection, headerOrientation, roleVariant, headerRole);
+                }
+
+            }
+            else if (reader.isEndElement()) {
+                if (reader.name() == versionName) {
+                    versionStarted = false;
+                }
+                if (reader.name() == headerDataName) {
+                    headerDataStarted = false;
+                }
+                else if (reader.name() == verticalName && headerDataStarted) {
+                    vHeaderDataStarted = false;
+                }
+                else if (reader.name() == horizontalName && headerDataStarted) {
+                    hHeaderDataStarted = false;
+                }
+            }
+        }
+        if (reader.hasError()) {
+            clearModel(context.model);
+            return false;
+        }
+        return true;
+    }
+
+    // Journals start with these bytes followed by the version and the stamp of the snapshot they apply to
+    const char journalMagic[] = { 'Q', 'M', 'S', 'J' };
+    const int journalMagicSize = sizeof(journalMagic);
+
+    enum JournalRecordType{
+        DataChangedRecord = 1
+        , RowsInsertedRecord
+        , RowsRemovedRecord
+        , ColumnsInsertedRecord
+        , ColumnsRemovedRecord
+        , HeaderDataChangedRecord
+    };
+
+    QString journalPath(const QString& snapshotPath)
+    {
+        return snapshotPath + QStringLiteral(".journal");
+    }
+
+    void writeJournalHeader(QDataStream& destination, const QFileInfo& snapshotInfo)
+    {
+        destination.setVersion(QDataStream::Qt_5_0);
+        destination.writeRawData(journalMagic, journalMagicSize);
+        destination << qint32(1) << qint32(0); // Major, Minor
+        destination << qint64(snapshotInfo.size()) << qint64(snapshotInfo.lastModified().toMSecsSinceEpoch());
+        destination << qint32(QDataStream().version());
+    }
+
+    bool readJournalHeader(QDataStream& source, const QFileInfo& snapshotInfo)
+    {
+        source.setVersion(QDataStream::Qt_5_0);
+        char magic[journalMagicSize];
+        if (source.readRawData(magic, journalMagicSize) != journalMagicSize || std::memcmp(magic, journalMagic, journalMagicSize) != 0)
+            return false;
+        qint32 majorVersion, minorVersion, valueStreamVersion;
+        qint64 snapshotSize, snapshotModified;
+        source >> majorVersion >> minorVersion >> snapshotSize >> snapshotModified >> valueStreamVersion;
+        Q_UNUSED(minorVersion)
+        if (source.status() != QDataStream::Ok || majorVersion != 1 || valueStreamVersion > QDataStream().version())
+            return false;
+        // A journal left behind by an older snapshot must not be applied to a newer one
+        if (snapshotSize != snapshotInfo.size() || snapshotModified != snapshotInfo.lastModified().toMSecsSinceEpoch())
+            return false;
+        source.setVersion(valueStreamVersion);
+        return true;
+    }
+
+    void writeIndexPath(QDataStream& destination, QModelIndex index)
+    {
+        QVector<QPair<qint32, qint32> > path;
+        for (; index.isValid(); index = index.parent())
+            path.prepend(qMakePair(qint32(index.row()), qint32(index.column())));
+        destination << path;
+    }
+
+    bool readIndexPath(QDataStream& source, const QAbstractItemModel* const model, QModelIndex& index)
+    {
+        QVector<QPair<qint32, qint32> > path;
+        source >> path;
+        if (source.status() != QDataStream::Ok)
+            return false;
+        index = QModelIndex();
+        for (const QPair<qint32, qint32>& step : path) {
+            index = model->index(step.first, step.second, index);
+            if (!index.isValid())
+                return false;
+        }
+        return true;
+    }
+
+    void appendJournalValue(QVector<BinaryDataPoint>& dataPoints, int role, const QVariant& value, int streamVersion)
+    {
+        BinaryDataPoint dataPoint;
+        dataPoint.role = role;
+        dataPoint.type = QMetaType::UnknownType; // Records that the role was cleared
+        if (!value.isNull()) {
+            if (!saveBinaryVariant(value, streamVersion, dataPoint.payload))
+                return; // Skip unhandled types
+            dataPoint.type = value.userType();
+        }
+        dataPoints.append(dataPoint);
+    }
+
+    bool readJournalValues(QDataStream& source, QMap<int, QVariant>& values)
+    {
+        quint32 dataPointCount;
+        qint32 dataRole, dataType;
+        QByteArray payload;
+        source >> dataPointCount;
+        for (quint32 k = 0; k < dataPointCount; ++k) {
+            source >> dataRole >> dataType >> payload;
+            if (source.status() != QDataStream::Ok)
+                return false;
+            if (dataType == QMetaType::UnknownType) {
+                values.insert(dataRole, QVariant());
+                continue;
+            }
+            const QVariant roleVariant = loadBinaryVariant(dataType, payload, source.version());
+            if (!roleVariant.isNull()) // skip unhandled types
+                values.insert(dataRole, roleVariant);
+        }
+        return source.status() == QDataStream::Ok;
+    }
+
+    bool replayJournalRecord(QDataStream& record, QAbstractItemModel* const model, quint8 recordType)
+    {
+        LoadContext context(model);
+        context.minorVersion = binaryMinorVersion;
+        QModelIndex parent;
+        if (recordType != HeaderDataChangedRecord && !readIndexPath(record, model, parent))
+            return false;
+        qint32 first, last;
+        record >> first >> last;
+        if (record.status() != QDataStream::Ok || first < 0 || last < first)
+            return false;
+        switch (recordType) {
+        case DataChangedRecord: {
+            qint32 firstColumn, lastColumn;
+            record >> firstColumn >> lastColumn;
+            QMap<int, QVariant> cellData;
+            for (int i = first; i <= last; ++i) {
+                for (int j = firstColumn; j <= lastColumn; ++j) {
+                    cellData.clear();
+                    if (!readJournalValues(record, cellData))
+                        return false;
+                    if (cellData.isEmpty())
+                        continue; // Only roles that can't be serialised changed
+                    // A cell that is missing or refuses the values means the model no longer matches the journal
+                    const QModelIndex cell = model->index(i, j, parent);
+                    if (!cell.isValid() || !model->setItemData(cell, cellData))
+                        return false;
+                }
+            }
+            return true;
+        }
+        case RowsInsertedRecord: {
+            qint32 colCount;
+            record >> colCount;
+            if (record.status() != QDataStream::Ok || !model->insertRows(first, last - first + 1, parent))
+                return false;
+            for (int i = first; i <= last; ++i) {
+                if (!readBinaryRow(record, context, parent, i, colCount))
+                    return false;
             }
+            return true;
         }
-        writer.writeEndElement(); // Horizontal
-        writer.writeStartElement(QStringLiteral("Vertical"));
-        for (int i = 0; i < model->rowCount(); ++i) {
-            foreach(int singleRole, rolesToSave)
-            {
-                const QVariant roleData = model->headerData(i, Qt::Vertical, singleRole);
-                if (roleData.isNull())
-                    continue;
-                const QString roleString = saveVariant(roleData);
-                if (roleString.isEmpty())
-                    continue; // Skip unhandled types
-                writer.writeStartElement(QStringLiteral("HeaderDataPoint"));
-                writer.writeAttribute(QStringLiteral("Section"), QString::number(i));
-                writer.writeAttribute(QStringLiteral("Role"), QString::number(singleRole));
-                writer.writeAttribute(QStringLiteral("Type"), QString::number(roleData.type()));
-                writer.writeCharacters(roleString);
-                writer.writeEndElement(); // HeaderDataPoint
+        case ColumnsInsertedRecord: {
+            qint32 rowCount;
+            record >> rowCount;
+            if (record.status() != QDataStream::Ok || !model->insertColumns(first, last - first + 1, parent))
+                return false;
+            for (int i = 0; i < rowCount; ++i) {
+                for (int j = first; j <= last; ++j) {
+                    if (!readBinaryCell(record, context, model->index(i, j, parent)))
+                        return false;
+                }
             }
+            return true;
+        }
+        case RowsRemovedRecord: return model->removeRows(first, last - first + 1, parent);
+        case ColumnsRemovedRecord: return model->removeColumns(first, last - first + 1, parent);
+        case HeaderDataChangedRecord: {
+            qint32 orientation;
+            record >> orientation;
+            QMap<int, QVariant> sectionData;
+            for (int i = first; i <= last; ++i) {
+                sectionData.clear();
+                if (!readJournalValues(record, sectionData))
+                    return false;
+                for (QMap<int, QVariant>::const_iterator j = sectionData.constBegin(); j != sectionData.constEnd(); ++j)
+                    model->setHeaderData(i, static_cast<Qt::Orientation>(orientation), j.value(), j.key());
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Reads past the records following the header, returns false if the last one was cut short by an interrupted append
+    bool skipJournalRecords(QDataStream& source)
+    {
+        quint8 recordType;
+        while (!source.atEnd()) {
+            source >> recordType;
+            if (source.status() != QDataStream::Ok || !skipBinaryPayload(source))
+                return false;
         }
-        writer.writeEndElement(); // Vertical
-        writer.writeEndElement(); // HeaderData
-        writer.writeEndElement(); // ItemModel
-        writer.writeEndDocument();
         return true;
     }
 
-    bool saveModel(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave)
+    bool replayJournal(QAbstractItemModel* const model, const QString& snapshotPath)
     {
-        QSaveFile destinationFile(destination);
-        if (!destinationFile.open(QIODevice::WriteOnly))
+        QFile journalFile(journalPath(snapshotPath));
+        if (!journalFile.exists())
+            return true;
+        if (!journalFile.open(QIODevice::ReadOnly))
             return false;
-        if (!saveModel(model, &destinationFile, rolesToSave))
+        QDataStream journalStream(&journalFile);
+        if (!readJournalHeader(journalStream, QFileInfo(snapshotPath)))
+            return true; // The journal belongs to a different snapshot
+        quint8 recordType;
+        QByteArray recordData;
+        while (!journalStream.atEnd()) {
+            journalStream >> recordType >> recordData;
+            // A record cut short by an interrupted append was never complete, the changes before it are kept.
+            // ModelJournal compacts before appending after such a record
+            if (journalStream.status() != QDataStream::Ok)
+                return journalFile.atEnd();
+            QDataStream record(recordData);
+            record.setVersion(journalStream.version());
+            if (!replayJournalRecord(record, model, recordType))
+                return false; // The model no longer matches what the following records refer to
+        }
+        return true;
+    }
+
+    bool readDocument(LoadContext& context, QIODevice* source)
+    {
+        if (source->peek(binaryMagicSize) == QByteArray::fromRawData(binaryMagic, binaryMagicSize))
+            return loadBinaryModel(context, source);
+        return loadXmlModel(context, source);
+    }
+
+    // If header is set the header data is collected there instead of being set on the model
+    bool loadDocument(QAbstractItemModel* const model, QIODevice* source, const LoadOptions& options, const QString& documentPath, HeaderValues* header = nullptr)
+    {
+        LoadContext context(model, OperationTracker(options.observer, source));
+        context.headerValues = header;
+        context.query = options.query;
+        context.bulkLoad = options.bulkLoad;
+        context.documentPath = documentPath;
+        bool result;
+        StreamCompression compression;
+        if (!readCompressionHeader(source, compression)) {
+            result = false;
+        }
+        else if (compression == NoCompression) {
+            result = readDocument(context, source);
+        }
+        else {
+            CompressionDevice decompressor(source, compression);
+            context.compressedPayloads = false;
+            result = decompressor.open(QIODevice::ReadOnly) && readDocument(context, &decompressor);
+        }
+        context.tracker.finish();
+        return result;
+    }
+
+    bool loadContent(QAbstractItemModel* const model, QIODevice* source, const LoadOptions& options, const QString& documentPath)
+    {
+        const ModelAdapter* const adapter = modelAdapter(model);
+        if (!adapter)
+            return loadDocument(model, source, options, documentPath);
+        // The document is read into the cells made by the adapter, which then hands them to the model through its own API.
+        // Nothing is attached to the cells so their changes are not worth notifying, the header data waits until the content is in place
+        LoadOptions cellsOptions = options;
+        cellsOptions.bulkLoad = false;
+        const QScopedPointer<QAbstractItemModel> cells(adapter->createCells(model));
+        HeaderValues header;
+        if (!cells || !loadDocument(cells.data(), source, cellsOptions, documentPath, &header) || !adapter->setContent(model, cells.data())) {
+            clearModel(model);
             return false;
-        return destinationFile.commit();
+        }
+        LoadContext context(model);
+        context.bulkLoad = options.bulkLoad;
+        applyHeaderData(context, header.horizontal, Qt::Horizontal);
+        applyHeaderData(context, header.vertical, Qt::Vertical);
+        return true;
     }
 
-    bool saveModel(const QAbstractItemModel* const model, const QString& destination)
+    // documentPath is the path of the document read from source, empty if it is not read from a file
+    bool loadFromDevice(QAbstractItemModel* const model, QIODevice* source, const LoadOptions& options, const QString& documentPath)
     {
-        return saveModel(model, destination, modelDefaultRoles());
+        if (!source->isReadable())
+            return false;
+        clearModel(model);
+        if (!loadContent(model, source, options, documentPath))
+            return false;
+        if (options.bulkLoad) {
+            // The header data was set with the model signals blocked
+            if (model->columnCount() > 0)
+                emit model->headerDataChanged(Qt::Horizontal, 0, model->columnCount() - 1);
+            if (model->rowCount() > 0)
+                emit model->headerDataChanged(Qt::Vertical, 0, model->rowCount() - 1);
+        }
+        return true;
     }
 
-    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination)
+    bool loadModel(QAbstractItemModel* const model, QIODevice* source, const LoadOptions& options)
     {
-        return saveModel(model, destination, modelDefaultRoles());
+        return loadFromDevice(model, source, options, QString());
     }
 
     bool loadModel(QAbstractItemModel* const model, QIODevice* source)
     {
-        if (!source->isReadable())
+        return loadModel(model, source, LoadOptions());
+    }
+
+    bool loadModel(QAbstractItemModel* const model, const QString& source, const LoadOptions& options)
+    {
+        QFile sourceFile(source);
+        if (!sourceFile.open(QIODevice::ReadOnly))
             return false;
-        model->removeColumns(0, model->columnCount());
-        model->removeRows(0, model->rowCount());
-        // Use these to implement versioning of the serialised values
-        int majorVersion = -1;
-        int minorVersion = -1;
-        int microVersion = -1;
-        QXmlStreamReader reader(source);
-        bool headerDataStarted = false;
-        bool hHeaderDataStarted = false;
-        bool vHeaderDataStarted = false;
-        bool versionStarted = false;
-        while (!reader.atEnd() && !reader.hasError()) {
-            reader.readNext();
-            if (reader.isStartElement()) {
-                if (reader.name() == QStringLiteral("Version")) {
-                    versionStarted = true;
-                }
-                else if (versionStarted && reader.name() == QStringLiteral("Major")) {
-                    majorVersion = reader.readElementText().toInt();
-                }
-                else if (versionStarted && reader.name() == QStringLiteral("Minor")) {
-                    minorVersion = reader.readElementText().toInt();
-                }
-                else if (versionStarted && reader.name() == QStringLiteral("Micro")) {
-                    microVersion = reader.readElementText().toInt();
+        // The blob file is only mapped if the document says it stores values there
+        if (!loadFromDevice(model, &sourceFile, options, source))
+            return false;
+        sourceFile.close();
+        if (!options.query.isEmpty())
+            return true; // The journal records refer to cells of the whole document
+        if (!replayJournal(model, source)) {
+            // Some records may have been replayed already, a model half way between the snapshot and the journal is not returned
+            clearModel(model);
+            return false;
+        }
+        return true;
+    }
+
+    bool loadModel(QAbstractItemModel* const model, const QString& source)
+    {
+        return loadModel(model, source, LoadOptions());
+    }
+
+    // Time given to each slice of an asynchronous save or load, well below the duration of a frame
+    const int asyncSliceMsecs = 8;
+
+    // Lets the worker of an asynchronous save or load see the cancellation of its future, calls are forwarded to the observer of the caller
+    class AsyncObserver : public SerialisationObserver
+    {
+    public:
+        AsyncObserver(const QFutureInterface<bool>& promise, SerialisationObserver* const forwarded)
+            : m_promise(promise)
+            , m_forwarded(forwarded)
+        {}
+        void progress(const SerialisationStatistics& statistics) override
+        {
+            if (m_forwarded)
+                m_forwarded->progress(statistics);
+        }
+        void finished(const SerialisationStatistics& statistics) override
+        {
+            if (m_forwarded)
+                m_forwarded->finished(statistics);
+        }
+        bool isCancelled() override
+        {
+            return m_promise.isCanceled() || (m_forwarded && m_forwarded->isCancelled());
+        }
+    private:
+        QFutureInterface<bool> m_promise;
+        SerialisationObserver* m_forwarded;
+    };
+
+    // Copies the model into a detached model in slices run by the event loop then saves the copy on a worker
+    class AsyncSave : public QObject
+    {
+        Q_DISABLE_COPY(AsyncSave)
+    public:
+        AsyncSave(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave, const SaveOptions& options)
+            : m_model(model)
+            , m_destination(destination)
+            , m_options(options)
+            , m_context(model, rolesToSave, options)
+            , m_observer(m_promise, options.observer)
+            , m_modelChanged(false)
+        {
+            m_options.useItemData = true; // The snapshot returns its roles from itemData
+            m_options.observer = &m_observer; // Lives until the worker is done, this object is only deleted once it finished
+            connect(&m_watcher, &QFutureWatcher<bool>::finished, this, &AsyncSave::finishSaving);
+            // A change between two slices would leave the copy with parts of two different models
+            connect(model, &QAbstractItemModel::dataChanged, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::headerDataChanged, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::rowsInserted, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::rowsRemoved, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::rowsMoved, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::columnsInserted, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::columnsRemoved, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::columnsMoved, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::layoutChanged, this, &AsyncSave::modelChanged);
+            connect(model, &QAbstractItemModel::modelReset, this, &AsyncSave::modelChanged);
+        }
+        QFuture<bool> start()
+        {
+            m_promise.reportStarted();
+            m_levels.append(PendingLevel());
+            QTimer::singleShot(0, this, &AsyncSave::copySlice);
+            return m_promise.future();
+        }
+    private:
+        struct PendingLevel
+        {
+            PendingLevel() : nextCell(0) {}
+            QModelIndex sourceParent;
+            QModelIndex snapshotParent;
+            int nextCell; // Position of the next cell to copy in row major order
+        };
+        void modelChanged()
+        {
+            m_modelChanged = true;
+        }
+        void copySlice()
+        {
+            if (!m_model || m_promise.isCanceled())
+                return finish(false);
+            if (m_modelChanged) {
+                // The indexes kept between slices may be stale, the copy is made again in one go so a model that keeps changing can't hold the save back
+                m_levels.clear();
+                clearModel(&m_snapshot);
+                SaveContext context(m_model, m_context.rolesToSave, m_context.options);
+                copyLevel(context, m_snapshot, QModelIndex(), QModelIndex());
+                copyHeaderData(context, m_snapshot, Qt::Horizontal);
+                copyHeaderData(context, m_snapshot, Qt::Vertical);
+                return startSaving();
+            }
+            QElapsedTimer sliceTimer;
+            sliceTimer.start();
+            QMap<int, QVariant> cellValues;
+            while (!m_levels.isEmpty()) {
+                PendingLevel level = m_levels.takeLast();
+                const int rowCount = m_context.rowCount(level.sourceParent);
+                const int colCount = m_context.columnCount(level.sourceParent);
+                if (level.nextCell == 0) {
+                    m_snapshot.insertRows(0, rowCount, level.snapshotParent);
+                    m_snapshot.insertColumns(0, colCount, level.snapshotParent);
                 }
-                else if (reader.name() == QStringLiteral("Element")) {
-                    if (!readElement(reader, model)) {
-                        model->removeColumns(0, model->columnCount());
-                        model->removeRows(0, model->rowCount());
-                        return false;
+                while (level.nextCell < rowCount * colCount) {
+                    const int row = level.nextCell / colCount;
+                    const int column = level.nextCell % colCount;
+                    ++level.nextCell;
+                    const QModelIndex sourceIndex = m_context.index(row, column, level.sourceParent);
+                    const QModelIndex snapshotIndex = m_snapshot.index(row, column, level.snapshotParent);
+                    copyCellData(m_context, m_snapshot, sourceIndex, snapshotIndex, cellValues);
+                    if (m_context.hasChildren(sourceIndex)) {
+                        PendingLevel childLevel;
+                        childLevel.sourceParent = sourceIndex;
+                        childLevel.snapshotParent = snapshotIndex;
+                        m_levels.append(childLevel);
+                    }
+                    if (sliceTimer.elapsed() >= asyncSliceMsecs) {
+                        m_levels.append(level);
+                        QTimer::singleShot(0, this, &AsyncSave::copySlice);
+                        return;
                     }
                 }
-                else if (reader.name() == QStringLiteral("HeaderData")) {
-                    headerDataStarted = true;
-                }
-                else if (reader.name() == QStringLiteral("Vertical") && headerDataStarted) {
-                    if (hHeaderDataStarted)
-                        return false;
-                    vHeaderDataStarted = true;
-                }
-                else if (reader.name() == QStringLiteral("Horizontal") && headerDataStarted) {
-                    if (vHeaderDataStarted)
-                        return false;
-                    hHeaderDataStarted = true;
-                }
-                else if (reader.name() == QStringLiteral("HeaderDataPoint") && headerDataStarted) {
-                    if (!(vHeaderDataStarted || hHeaderDataStarted))
-                        return false;
-                    const QXmlStreamAttributes headDataAttribute = reader.attributes();
-                    if (!(
-                        headDataAttribute.hasAttribute(QStringLiteral("Section"))
-                        && headDataAttribute.hasAttribute(QStringLiteral("Role"))
-                        && headDataAttribute.hasAttribute(QStringLiteral("Type"))
-                        ))
-                        return false;
-                    int headerSection = headDataAttribute.value(QStringLiteral("Section")).toInt();
-                    int headerRole = headDataAttribute.value(QStringLiteral("Role")).toInt();
-                    int headerType = headDataAttribute.value(QStringLiteral("Type")).toInt();
-                    const QVariant roleVariant = loadVariant(headerType, reader.readElementText());
-                    if (!roleVariant.isNull()) // skip unhandled types
-                        model->setHeaderData(headerSection, (vHeaderDataStarted ? Qt::Vertical : Qt::Horizontal), roleVariant, headerRole);
-                }
+            }
+            copyHeaderData(m_context, m_snapshot, Qt::Horizontal);
+            copyHeaderData(m_context, m_snapshot, Qt::Vertical);
+            startSaving();
+        }
+        void startSaving()
+        {
+            // The worker never touches the model, only the copy
+            DetachedModel* const snapshot = &m_snapshot;
+            const QString destination = m_destination;
+            const QList<int> rolesToSave = m_context.rolesToSave;
+            const SaveOptions options = m_options;
+            m_watcher.setFuture(QtConcurrent::run([snapshot, destination, rolesToSave, options]() {
+                return saveModel(snapshot, destination, rolesToSave, options);
+            }));
+        }
+        void finishSaving()
+        {
+            finish(m_watcher.result());
+        }
+        void finish(bool result)
+        {
+            m_promise.reportResult(result);
+            m_promise.reportFinished();
+            deleteLater();
+        }
+        QPointer<const QAbstractItemModel> m_model;
+        QString m_destination;
+        SaveOptions m_options; // The options of the worker
+        SaveContext m_context; // Reads the model between slices, holds the options of the caller
+        DetachedModel m_snapshot;
+        QFutureWatcher<bool> m_watcher;
+        QFutureInterface<bool> m_promise;
+        AsyncObserver m_observer;
+        QVector<PendingLevel> m_levels; // Levels not copied yet, the last one is copied first
+        bool m_modelChanged; // Set when the model changed since the copy started
+    };
+
+    QFuture<bool> saveModelAsync(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave, const SaveOptions& options)
+    {
+        AsyncSave* const save = new AsyncSave(model, destination, rolesToSave, options);
+        return save->start();
+    }
+
+    QFuture<bool> saveModelAsync(const QAbstractItemModel* const model, const QString& destination)
+    {
+        return saveModelAsync(model, destination, modelDefaultRoles(), SaveOptions());
+    }
 
+    // Reads a file into a detached model on a worker then applies it to the model in slices run by the event loop
+    class AsyncLoad : public QObject
+    {
+        Q_DISABLE_COPY(AsyncLoad)
+    public:
+        AsyncLoad(QAbstractItemModel* const model, const QString& source, const LoadOptions& options)
+            : m_model(model)
+            , m_source(source)
+            , m_options(options)
+            , m_observer(m_promise, options.observer)
+        {
+            m_options.bulkLoad = false; // The copy has nothing attached, the model is filled a slice at a time
+            m_options.observer = &m_observer; // Lives until the worker is done, this object is only deleted once it finished
+            connect(&m_watcher, &QFutureWatcher<bool>::finished, this, &AsyncLoad::startApplying);
+        }
+        QFuture<bool> start()
+        {
+            m_promise.reportStarted();
+            DetachedModel* const detached = &m_detached;
+            const QString source = m_source;
+            const LoadOptions options = m_options;
+            m_watcher.setFuture(QtConcurrent::run([detached, source, options]() {
+                return loadModel(detached, source, options);
+            }));
+            return m_promise.future();
+        }
+    private:
+        struct PendingLevel
+        {
+            PendingLevel() : nextCell(0) {}
+            QModelIndex detachedParent;
+            QPersistentModelIndex targetParent;
+            int nextCell; // Position of the next cell to apply in row major order
+        };
+        void startApplying()
+        {
+            if (!m_watcher.result() || !m_model || m_promise.isCanceled())
+                return finish(false);
+            clearModel(m_model);
+            m_levels.append(PendingLevel());
+            applySlice();
+        }
+        void applySlice()
+        {
+            if (!m_model || m_promise.isCanceled()) {
+                if (m_model)
+                    clearModel(m_model);
+                return finish(false);
             }
-            else if (reader.isEndElement()) {
-                if (reader.name() == QStringLiteral("Version")) {
-                    versionStarted = false;
-                }
-                if (reader.name() == QStringLiteral("HeaderData")) {
-                    headerDataStarted = false;
-                }
-                else if (reader.name() == QStringLiteral("Vertical") && headerDataStarted) {
-                    vHeaderDataStarted = false;
-                }
-                else if (reader.name() == QStringLiteral("Horizontal") && headerDataStarted) {
-                    hHeaderDataStarted = false;
+            QElapsedTimer sliceTimer;
+            sliceTimer.start();
+            LoadContext context(m_model);
+            while (!m_levels.isEmpty()) {
+                PendingLevel level = m_levels.takeLast();
+                if (level.detachedParent.isValid() && !level.targetParent.isValid())
+                    continue; // The parent was removed from the model in the meantime
+                const int rowCount = m_detached.rowCount(level.detachedParent);
+                const int colCount = m_detached.columnCount(level.detachedParent);
+                if (level.nextCell == 0)
+                    context.ensureSize(level.targetParent, rowCount, colCount);
+                while (level.nextCell < rowCount * colCount) {
+                    const int row = level.nextCell / colCount;
+                    const int column = level.nextCell % colCount;
+                    ++level.nextCell;
+                    const QModelIndex detachedIndex = m_detached.index(row, column, level.detachedParent);
+                    const QModelIndex targetIndex = context.index(row, column, level.targetParent);
+                    const QMap<int, QVariant> cellData = m_detached.itemData(detachedIndex);
+                    if (!cellData.isEmpty())
+                        context.setItemData(targetIndex, cellData);
+                    if (m_detached.hasChildren(detachedIndex)) {
+                        PendingLevel childLevel;
+                        childLevel.detachedParent = detachedIndex;
+                        childLevel.targetParent = targetIndex;
+                        m_levels.append(childLevel);
+                    }
+                    if (sliceTimer.elapsed() >= asyncSliceMsecs) {
+                        m_levels.append(level);
+                        QTimer::singleShot(0, this, &AsyncLoad::applySlice);
+                        return;
+                    }
                 }
             }
+            applyHeaderData(context, m_detached.headerValues(Qt::Horizontal), Qt::Horizontal);
+            applyHeaderData(context, m_detached.headerValues(Qt::Vertical), Qt::Vertical);
+            finish(true);
         }
-        if (reader.hasError()) {
-            model->removeColumns(0, model->columnCount());
-            model->removeRows(0, model->rowCount());
+        void finish(bool result)
+        {
+            m_promise.reportResult(result);
+            m_promise.reportFinished();
+            deleteLater();
+        }
+        QPointer<QAbstractItemModel> m_model;
+        QString m_source;
+        LoadOptions m_options;
+        DetachedModel m_detached;
+        QFutureWatcher<bool> m_watcher;
+        QFutureInterface<bool> m_promise;
+        AsyncObserver m_observer;
+        QVector<PendingLevel> m_levels; // Levels not applied yet, the last one is applied first
+    };
+
+    QFuture<bool> loadModelAsync(QAbstractItemModel* const model, const QString& source, const LoadOptions& options)
+    {
+        AsyncLoad* const load = new AsyncLoad(model, source, options);
+        return load->start();
+    }
+
+    QFuture<bool> loadModelAsync(QAbstractItemModel* const model, const QString& source)
+    {
+        return loadModelAsync(model, source, LoadOptions());
+    }
+
+    LazyLoadProxyModel::LazyLoadProxyModel(QObject* parent)
+        : QIdentityProxyModel(parent)
+        , m_source(nullptr)
+        , m_ownedSource(nullptr)
+        , m_minorVersion(0)
+        , m_valueStreamVersion(0)
+        , m_pendingLookupValid(false)
+    {
+        // The source indexes the lookup is keyed by move when the structure of the model changes
+        connect(this, &QAbstractItemModel::rowsInserted, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::rowsRemoved, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::rowsMoved, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::columnsInserted, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::columnsRemoved, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::columnsMoved, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::layoutChanged, this, &LazyLoadProxyModel::invalidatePendingLookup);
+        connect(this, &QAbstractItemModel::modelReset, this, &LazyLoadProxyModel::invalidatePendingLookup);
+    }
+
+    bool LazyLoadProxyModel::loadModel(QAbstractItemModel* const model, QIODevice* source)
+    {
+        m_pendingSubtrees.clear();
+        invalidatePendingLookup();
+        m_source = nullptr;
+        setSourceModel(model);
+        if (!source->isReadable() || source->isSequential())
+            return false;
+        clearModel(model);
+        QDataStream reader(source);
+        LoadContext context(model);
+        context.pendingSubtrees = &m_pendingSubtrees;
+        quint32 flags;
+        QString blobFileName;
+        if (!readBinaryHeader(reader, context.minorVersion, flags, blobFileName) || context.minorVersion < 1) // Subtree sizes are needed to skip the subtrees
+            return false;
+        if (flags & SharedValuesFlag) // A subtree could refer to values written in a subtree that was skipped
+            return false;
+        if (flags & BlobsFlag) // The blob file is only mapped while the document is read
+            return false;
+        if (flags & ColumnarFlag) // Flat tables have no subtrees to fetch later
+            return false;
+        if (!(
+            readBinaryElement(reader, context)
+            && readBinaryHeaderData(reader, context, Qt::Horizontal)
+            && readBinaryHeaderData(reader, context, Qt::Vertical)
+            )) {
+            m_pendingSubtrees.clear();
+            clearModel(model);
             return false;
         }
+        m_source = source;
+        m_minorVersion = context.minorVersion;
+        m_valueStreamVersion = reader.version();
         return true;
     }
 
-    bool loadModel(QAbstractItemModel* const model, const QString& source)
+    bool LazyLoadProxyModel::loadModel(QAbstractItemModel* const model, const QString& source)
     {
-        QFile sourceFile(source);
-        if (!sourceFile.open(QIODevice::ReadOnly))
+        QFile* const sourceFile = new QFile(source, this);
+        if (!sourceFile->open(QIODevice::ReadOnly) || !loadModel(model, sourceFile)) {
+            delete sourceFile;
+            return false;
+        }
+        delete m_ownedSource;
+        m_ownedSource = sourceFile;
+        return true;
+    }
+
+    bool LazyLoadProxyModel::hasChildren(const QModelIndex& parent) const
+    {
+        if (pendingSubtree(mapToSource(parent)) >= 0)
+            return true;
+        return QIdentityProxyModel::hasChildren(parent);
+    }
+
+    bool LazyLoadProxyModel::canFetchMore(const QModelIndex& parent) const
+    {
+        if (pendingSubtree(mapToSource(parent)) >= 0)
+            return true;
+        return QIdentityProxyModel::canFetchMore(parent);
+    }
+
+    void LazyLoadProxyModel::fetchMore(const QModelIndex& parent)
+    {
+        const QModelIndex sourceParent = mapToSource(parent);
+        const qint64 subtreePosition = pendingSubtree(sourceParent);
+        if (subtreePosition < 0)
+            return QIdentityProxyModel::fetchMore(parent);
+        const QPersistentModelIndex pendingParent(sourceParent);
+        m_pendingSubtrees.remove(pendingParent);
+        invalidatePendingLookup();
+        QAbstractItemModel* const model = sourceModel();
+        bool subtreeRead = m_source && m_source->seek(subtreePosition);
+        if (subtreeRead) {
+            QDataStream reader(m_source);
+            reader.setVersion(m_valueStreamVersion);
+            LoadContext context(model);
+            context.minorVersion = m_minorVersion;
+            context.pendingSubtrees = &m_pendingSubtrees;
+            // Only this level is read, the subtrees below it are left pending in turn
+            subtreeRead = readBinaryElement(reader, context, sourceParent);
+        }
+        if (subtreeRead)
+            return;
+        // What was read of the level is removed along with the subtrees it left pending, so it can be fetched again
+        model->removeRows(0, model->rowCount(sourceParent), sourceParent);
+        model->removeColumns(0, model->columnCount(sourceParent), sourceParent);
+        for (QHash<QPersistentModelIndex, qint64>::iterator i = m_pendingSubtrees.begin(); i != m_pendingSubtrees.end();) {
+            if (i.key().isValid())
+                ++i;
+            else
+                i = m_pendingSubtrees.erase(i);
+        }
+        m_pendingSubtrees.insert(pendingParent, subtreePosition);
+        invalidatePendingLookup();
+        emit loadError(parent);
+    }
+
+    // Position of the subtree of a source index that is still to be read, -1 if there is none.
+    // Looking up a QPersistentModelIndex would search the persistent indexes of the model on every call from the view
+    qint64 LazyLoadProxyModel::pendingSubtree(const QModelIndex& sourceIndex) const
+    {
+        if (!sourceIndex.isValid() || m_pendingSubtrees.isEmpty())
+            return -1;
+        if (!m_pendingLookupValid) {
+            m_pendingLookup.clear();
+            m_pendingLookup.reserve(m_pendingSubtrees.size());
+            for (QHash<QPersistentModelIndex, qint64>::const_iterator i = m_pendingSubtrees.constBegin(); i != m_pendingSubtrees.constEnd(); ++i) {
+                if (i.key().isValid())
+                    m_pendingLookup.insert(i.key(), i.value());
+            }
+            m_pendingLookupValid = true;
+        }
+        return m_pendingLookup.value(sourceIndex, -1);
+    }
+
+    void LazyLoadProxyModel::invalidatePendingLookup()
+    {
+        m_pendingLookupValid = false;
+    }
+
+    ModelJournal::ModelJournal(QAbstractItemModel* model, const QString& snapshotPath, const QList<int>& rolesToTrack, QObject* parent)
+        : QObject(parent)
+        , m_model(model)
+        , m_snapshotPath(snapshotPath)
+        , m_rolesToTrack(rolesToTrack)
+        , m_requiresSnapshot(false)
+        , m_journalVerified(false)
+    {
+        connect(model, &QAbstractItemModel::dataChanged, this, &ModelJournal::recordDataChanged);
+        connect(model, &QAbstractItemModel::rowsInserted, this, &ModelJournal::recordRowsInserted);
+        connect(model, &QAbstractItemModel::rowsRemoved, this, &ModelJournal::recordRowsRemoved);
+        connect(model, &QAbstractItemModel::columnsInserted, this, &ModelJournal::recordColumnsInserted);
+        connect(model, &QAbstractItemModel::columnsRemoved, this, &ModelJournal::recordColumnsRemoved);
+        connect(model, &QAbstractItemModel::headerDataChanged, this, &ModelJournal::recordHeaderDataChanged);
+        // These changes can't be expressed as records, the next flush writes a new snapshot instead
+        connect(model, &QAbstractItemModel::rowsMoved, this, &ModelJournal::requireSnapshot);
+        connect(model, &QAbstractItemModel::columnsMoved, this, &ModelJournal::requireSnapshot);
+        connect(model, &QAbstractItemModel::layoutChanged, this, &ModelJournal::requireSnapshot);
+        connect(model, &QAbstractItemModel::modelReset, this, &ModelJournal::requireSnapshot);
+    }
+
+    ModelJournal::ModelJournal(QAbstractItemModel* model, const QString& snapshotPath, QObject* parent)
+        : ModelJournal(model, snapshotPath, modelDefaultRoles(), parent)
+    {}
+
+    const SaveOptions& ModelJournal::saveOptions() const
+    {
+        return m_saveOptions;
+    }
+
+    void ModelJournal::setSaveOptions(const SaveOptions& options)
+    {
+        m_saveOptions = options;
+    }
+
+    bool ModelJournal::hasPendingChanges() const
+    {
+        return m_requiresSnapshot || !m_pendingRecords.isEmpty();
+    }
+
+    bool ModelJournal::flush()
+    {
+        if (m_requiresSnapshot || !journalIsCurrent())
+            return compact();
+        if (m_pendingRecords.isEmpty())
+            return true;
+        QFile journalFile(journalPath(m_snapshotPath));
+        if (!(
+            journalFile.open(QIODevice::WriteOnly | QIODevice::Append)
+            && journalFile.write(m_pendingRecords) == m_pendingRecords.size()
+            && journalFile.flush()
+            )) {
+            // A partially written record would hide everything appended after it
+            m_requiresSnapshot = true;
+            m_journalVerified = false;
+            return false;
+        }
+        m_pendingRecords.clear();
+        return true;
+    }
+
+    bool ModelJournal::compact()
+    {
+        if (!m_model || !saveModel(m_model, m_snapshotPath, m_rolesToTrack, m_saveOptions))
+            return false;
+        // The snapshot holds every change now, if the journal can't be reset the next flush compacts again
+        m_pendingRecords.clear();
+        m_requiresSnapshot = true;
+        m_journalVerified = false;
+        QSaveFile journalFile(journalPath(m_snapshotPath));
+        if (!journalFile.open(QIODevice::WriteOnly))
+            return false;
+        QDataStream journalStream(&journalFile);
+        writeJournalHeader(journalStream, QFileInfo(m_snapshotPath));
+        if (journalStream.status() != QDataStream::Ok || !journalFile.commit())
+            return false;
+        m_requiresSnapshot = false;
+        m_journalVerified = true;
+        return true;
+    }
+
+    bool ModelJournal::journalIsCurrent()
+    {
+        if (m_journalVerified)
+            return true; // Only this object appended to the journal since it was last checked
+        QFile journalFile(journalPath(m_snapshotPath));
+        if (!journalFile.open(QIODevice::ReadOnly))
             return false;
-        return loadModel(model, &sourceFile);
+        QDataStream journalStream(&journalFile);
+        // Records are kept in memory with the stream version of this Qt so the journal must use the same.
+        // Records appended after one cut short would never be replayed so such a journal must be compacted
+        m_journalVerified = readJournalHeader(journalStream, QFileInfo(m_snapshotPath))
+            && journalStream.version() == QDataStream().version()
+            && skipJournalRecords(journalStream);
+        return m_journalVerified;
+    }
+
+    void ModelJournal::appendRecord(int recordType, const QByteArray& recordData)
+    {
+        QDataStream pendingStream(&m_pendingRecords, QIODevice::Append);
+        pendingStream.setVersion(QDataStream::Qt_5_0);
+        pendingStream << quint8(recordType) << recordData;
+    }
+
+    void ModelJournal::requireSnapshot()
+    {
+        m_requiresSnapshot = true;
+        m_pendingRecords.clear();
+    }
+
+    void ModelJournal::recordDataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles)
+    {
+        if (m_requiresSnapshot || !topLeft.isValid() || !bottomRight.isValid())
+            return;
+        QList<int> changedRoles;
+        foreach(int singleRole, m_rolesToTrack)
+        {
+            if (roles.isEmpty() || roles.contains(singleRole))
+                changedRoles.append(singleRole);
+        }
+        if (changedRoles.isEmpty())
+            return;
+        const QModelIndex parent = topLeft.parent();
+        QByteArray recordData;
+        QDataStream record(&recordData, QIODevice::WriteOnly);
+        writeIndexPath(record, parent);
+        record << qint32(topLeft.row()) << qint32(bottomRight.row()) << qint32(topLeft.column()) << qint32(bottomRight.column());
+        QVector<BinaryDataPoint> dataPoints;
+        for (int i = topLeft.row(); i <= bottomRight.row(); ++i) {
+            for (int j = topLeft.column(); j <= bottomRight.column(); ++j) {
+                const QModelIndex cellIndex = m_model->index(i, j, parent);
+                dataPoints.clear();
+                foreach(int singleRole, changedRoles)
+                    appendJournalValue(dataPoints, singleRole, cellIndex.data(singleRole), record.version());
+                writeBinaryDataPoints(record, dataPoints);
+            }
+        }
+        appendRecord(DataChangedRecord, recordData);
+    }
+
+    void ModelJournal::recordRowsInserted(const QModelIndex& parent, int first, int last)
+    {
+        if (m_requiresSnapshot)
+            return;
+        // The rows are recorded with their content as models can insert rows that already hold data
+        const int colCount = m_model->columnCount(parent);
+        QByteArray recordData;
+        QDataStream record(&recordData, QIODevice::WriteOnly);
+        writeIndexPath(record, parent);
+        record << qint32(first) << qint32(last) << qint32(colCount);
+        SaveContext context(m_model, m_rolesToTrack, SaveOptions());
+        for (int i = first; i <= last; ++i)
+            writeBinaryRow(record, context, parent, i);
+        appendRecord(RowsInsertedRecord, recordData);
+    }
+
+    void ModelJournal::recordColumnsInserted(const QModelIndex& parent, int first, int last)
+    {
+        if (m_requiresSnapshot)
+            return;
+        const int rowCount = m_model->rowCount(parent);
+        QByteArray recordData;
+        QDataStream record(&recordData, QIODevice::WriteOnly);
+        writeIndexPath(record, parent);
+        record << qint32(first) << qint32(last) << qint32(rowCount);
+        SaveContext context(m_model, m_rolesToTrack, SaveOptions());
+        for (int i = 0; i < rowCount; ++i) {
+            for (int j = first; j <= last; ++j)
+                writeBinaryCell(record, context, m_model->index(i, j, parent));
+        }
+        appendRecord(ColumnsInsertedRecord, recordData);
+    }
+
+    void ModelJournal::recordRowsRemoved(const QModelIndex& parent, int first, int last)
+    {
+        recordRemoval(RowsRemovedRecord, parent, first, last);
+    }
+
+    void ModelJournal::recordColumnsRemoved(const QModelIndex& parent, int first, int last)
+    {
+        recordRemoval(ColumnsRemovedRecord, parent, first, last);
+    }
+
+    void ModelJournal::recordRemoval(int recordType, const QModelIndex& parent, int first, int last)
+    {
+        if (m_requiresSnapshot)
+            return;
+        QByteArray recordData;
+        QDataStream record(&recordData, QIODevice::WriteOnly);
+        writeIndexPath(record, parent);
+        record << qint32(first) << qint32(last);
+        appendRecord(recordType, recordData);
+    }
+
+    void ModelJournal::recordHeaderDataChanged(Qt::Orientation orientation, int first, int last)
+    {
+        if (m_requiresSnapshot)
+            return;
+        QByteArray recordData;
+        QDataStream record(&recordData, QIODevice::WriteOnly);
+        record << qint32(first) << qint32(last) << qint32(orientation);
+        QVector<BinaryDataPoint> dataPoints;
+        for (int i = first; i <= last; ++i) {
+            dataPoints.clear();
+            foreach(int singleRole, m_rolesToTrack)
+                appendJournalValue(dataPoints, singleRole, m_model->headerData(i, orientation, singleRole), record.version());
+            writeBinaryDataPoints(record, dataPoints);
+        }
+        appendRecord(HeaderDataChangedRecord, recordData);
     }
 }
\ No newline at end of file
@@ -19,10 +19,186 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef modelserialisation_h__
 #define modelserialisation_h__
 #include <QList>
+#include <QByteArray>
+#include <QFuture>
+#include <QHash>
+#include <QIdentityProxyModel>
+#include <QPair>
+#include <QPointer>
+#include <QString>
+#include <QVector>
 class QAbstractItemModel;
 class QString;
 class QIODevice;
+class QVariant;
 namespace ModelSerialisation{
+    /*!
+    \brief The formats a model can be serialised to
+    \details loadModel detects the format of the source automatically
+    */
+    enum SerialisationFormat{
+        XmlFormat /*!< Human readable xml document */
+        , BinaryFormat /*!< Compact QDataStream based document */
+    };
+    /*!
+    \brief The text encodings for values the xml format stores as serialised binary data
+    \details The encoding is recorded in each DataPoint so documents can mix them
+    */
+    enum PayloadEncoding{
+        HexPayload /*!< Two hex digits per byte */
+        , Base64Payload /*!< Base64, a third smaller than hex */
+    };
+    /*!
+    \brief The versions of the xml schema
+    \details loadModel reads every version, the version of a document is recorded in its Version block
+    */
+    enum XmlVersion{
+        XmlVersion1 = 1 /*!< Every cell is written with its row and column as child elements */
+        , XmlVersion2 = 2 /*!< Empty cells are left out, the coordinates are implied by the order of the cells and short values are stored in attributes */
+    };
+    /*!
+    \brief The compressions applied to a whole document
+    \details Compressed documents start with a header naming the compression so loadModel detects it.
+    Xml documents inside a compressed one don't compress each serialised value on its own
+    */
+    enum StreamCompression{
+        NoCompression /*!< The document is written as is */
+        , ZlibCompression /*!< Streaming deflate through zlib, only available if the library is built with MODELSERIALISATION_ZLIB defined */
+        , ZstdCompression /*!< Streaming zstd, only available if the library is built with MODELSERIALISATION_ZSTD defined */
+    };
+    /*!
+    \brief Counters describing a save or a load while it runs
+    \details Times are in nanoseconds. In a parallel save the time spent by the workers is summed,
+    so encodingTime and modelTime can exceed totalTime
+    */
+    struct SerialisationStatistics{
+        /*!
+        \brief Number of values and size of their serialised form, in characters for xml and bytes for binary documents
+        */
+        struct ValueStatistics{
+            ValueStatistics() : count(0), payloadSize(0) {}
+            qint64 count;
+            qint64 payloadSize;
+        };
+        SerialisationStatistics()
+            : cellsProcessed(0), cellsTotal(0), bytesProcessed(0), totalTime(0), encodingTime(0), modelTime(0), streamTime(0)
+        {}
+        qint64 cellsProcessed; /*!< Cells saved or loaded so far */
+        qint64 cellsTotal; /*!< Cells in the levels reached so far, it grows as the children of the cells are reached */
+        qint64 bytesProcessed; /*!< Position in the device, always 0 for sequential devices */
+        qint64 totalTime; /*!< Time since the operation started */
+        qint64 encodingTime; /*!< Time spent converting values to and from their serialised form */
+        qint64 modelTime; /*!< Time spent in calls to the model */
+        qint64 streamTime; /*!< Time spent reading and writing the document, what is left of totalTime */
+        QHash<int, ValueStatistics> roles; /*!< Values by role */
+        QHash<int, ValueStatistics> types; /*!< Values by QMetaType id */
+    };
+    /*!
+    \brief Receives the progress of a save or a load and can cancel it
+    \details All the methods are called on the thread running the operation.
+    Statistics are only collected when an observer is set
+    */
+    class SerialisationObserver{
+    public:
+        virtual ~SerialisationObserver() {}
+        /*!
+        \brief Called every few hundred cells while the operation runs
+        */
+        virtual void progress(const SerialisationStatistics& statistics) { Q_UNUSED(statistics) }
+        /*!
+        \brief Called once when the operation ends, whether it succeeded or not
+        */
+        virtual void finished(const SerialisationStatistics& statistics) { Q_UNUSED(statistics) }
+        /*!
+        \brief Polled after each call to progress, returning true stops the operation
+        \details A cancelled save returns false, saving to a file leaves the existing file untouched.
+        A cancelled load returns false and leaves the model empty
+        */
+        virtual bool isCancelled() { return false; }
+    };
+    /*!
+    \brief Options controlling how a model is saved
+    */
+    struct SaveOptions{
+        SaveOptions() : format(XmlFormat), payloadEncoding(HexPayload), xmlVersion(XmlVersion1), compression(NoCompression), compressionLevel(-1), blobThreshold(0), parallelSave(false), deduplicateValues(false), columnarLayout(false), useItemData(false), observer(nullptr) {}
+        SerialisationFormat format; /*!< The format the model is written in */
+        PayloadEncoding payloadEncoding; /*!< The encoding of binary values in the xml format */
+        XmlVersion xmlVersion; /*!< The schema of the xml format, documents using XmlVersion2 can't be read by older versions of this code */
+        StreamCompression compression; /*!< Compress the whole document, compressed documents can't be read by LazyLoadProxyModel */
+        int compressionLevel; /*!< The level passed to the compression library, -1 for its default */
+        /*!
+        Serialised values of at least this many bytes are stored raw in a blob file next to the document, named after it followed by a unique id and a .blobs suffix.
+        The document records the name of its blob file. Each save writes a new one before the document is replaced and removes the previous one afterwards,
+        so a save that fails or is interrupted leaves the previous document loadable. Loading maps the blob file only if the document refers to one and decodes the values in place.
+        Only used when saving to a file path, 0 keeps every value in the document.
+        parallelSave is ignored and the binary documents can't be read by LazyLoadProxyModel
+        */
+        int blobThreshold;
+        /*!
+        Encode the top level rows on the global QThreadPool. The output is identical to the serial save.
+        The model must not change during the save and its data() must be safe to call from several threads
+        */
+        bool parallelSave;
+        /*!
+        Write each distinct serialised value once and refer to it by id afterwards, loading decodes it once and shares the QVariant.
+        In xml documents only the values stored as payloads are shared, in binary documents the values of at least 16 bytes.
+        parallelSave is ignored and the binary documents can't be read by LazyLoadProxyModel
+        */
+        bool deduplicateValues;
+        /*!
+        In BinaryFormat, store a model whose top level cells have no children one column at a time.
+        Each role of a column becomes one array with a bitmap of the rows holding a value followed by the numbers, the characters of the strings or the serialised values one after the other.
+        Large flat tables get smaller and their values are decoded without per value tags, the model is still filled one cell at a time.
+        Saving checks every top level cell for children before writing. Not used with deduplicateValues or blobThreshold, parallelSave is ignored and the documents can't be read by LazyLoadProxyModel
+        */
+        bool columnarLayout;
+        /*!
+        Qt 5 only, get the roles of a cell with a single call to itemData instead of one call to data per role.
+        Only set it if the model reimplements itemData to return its roles, QAbstractItemModel::itemData calls data for every role below Qt::UserRole.
+        If Qt::EditRole is saved and missing from itemData, like in QStandardItemModel, it is asked from data.
+        On Qt 6 the roles are always retrieved with a single call to multiData
+        */
+        bool useItemData;
+        SerialisationObserver* observer; /*!< Receives the progress of the save, not owned */
+    };
+    /*!
+    \brief Selects the part of a document that is loaded
+    \details Everything outside the query is skipped without being decoded and without calling setData.
+    Header data is only loaded when subtreePath is empty, vertical header sections follow the row range.
+    */
+    struct LoadQuery{
+        LoadQuery() : firstRow(0), lastRow(-1), maxDepth(-1) {}
+        /*!
+        \brief Returns true if the query selects the whole document
+        */
+        bool isEmpty() const { return roles.isEmpty() && subtreePath.isEmpty() && firstRow <= 0 && lastRow < 0 && maxDepth < 0; }
+        QList<int> roles; /*!< The roles to load, all of them if empty */
+        /*!
+        Row and column of each cell from the top level down to the cell whose children are loaded as the top level of the model.
+        The values of the cells along the path are not loaded. If empty the selected level is the top level of the document
+        */
+        QVector<QPair<int, int> > subtreePath;
+        int firstRow; /*!< First row of the selected level to load, it becomes row 0 of the model */
+        int lastRow; /*!< Last row of the selected level to load, -1 loads up to the last row */
+        int maxDepth; /*!< Number of levels loaded below the selected one, -1 loads all of them */
+    };
+    /*!
+    \brief Options controlling how a model is loaded
+    */
+    struct LoadOptions{
+        LoadOptions() : bulkLoad(false), observer(nullptr) {}
+        /*!
+        Notify attached views and proxies once per level instead of once per cell. Rows and columns are still inserted with their usual signals,
+        the values of the cells of a level are set with the model signals blocked and announced by a single dataChanged covering the level once it is read.
+        Header data is announced by one headerDataChanged per orientation at the end. The model must not rely on receiving its own dataChanged signals
+        */
+        bool bulkLoad;
+        /*!
+        Load only part of the document, the journal of a snapshot is not replayed when the query is not empty
+        */
+        LoadQuery query;
+        SerialisationObserver* observer; /*!< Receives the progress of the load, not owned */
+    };
     /*!
     \brief A list of default roles in the model
     \details Returns a list containing all non-obsolete Qt::ItemDataRole values
@@ -39,6 +215,14 @@ namespace ModelSerialisation{
     \brief Save the model to file
     \arg \c model The model to save
     \arg \c destination The path to the file the model is to be saved to
+    \arg \c rolesToSave The roles in the model data that should be saved
+    \arg \c options The options controlling the output
+    */
+    bool saveModel(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave, const SaveOptions& options);
+    /*!
+    \brief Save the model to file
+    \arg \c model The model to save
+    \arg \c destination The path to the file the model is to be saved to
     \details All non-obsolete Qt::ItemDataRole will be saved
     */
     bool saveModel(const QAbstractItemModel* const model, const QString& destination);
@@ -53,6 +237,14 @@ namespace ModelSerialisation{
     \brief Writes the model to a device
     \arg \c model The model to save
     \arg \c destination The device the model is to be written to
+    \arg \c rolesToSave The roles in the model data that should be saved
+    \arg \c options The options controlling the output
+    */
+    bool saveModel(const QAbstractItemModel* const model, QIODevice* destination, const QList<int>& rolesToSave, const SaveOptions& options);
+    /*!
+    \brief Writes the model to a device
+    \arg \c model The model to save
+    \arg \c destination The device the model is to be written to
     \details All non-obsolete Qt::ItemDataRole will be saved
     */
     bool saveModel(const QAbstractItemModel* const model, QIODevice* destination);
@@ -60,13 +252,240 @@ namespace ModelSerialisation{
     \brief Reads a model from a device
     \arg \c model The model that will be loaded
     \arg \c source The device the model is to be read from
+    \details Both xml and binary documents are accepted, the format is detected from the content of the device
     */
     bool loadModel(QAbstractItemModel* const model, QIODevice* source);
     /*!
     \brief Reads a model from a device
     \arg \c model The model that will be loaded
+    \arg \c source The device the model is to be read from
+    \arg \c options The options controlling the load
+    */
+    bool loadModel(QAbstractItemModel* const model, QIODevice* source, const LoadOptions& options);
+    /*!
+    \brief Reads a model from a device
+    \arg \c model The model that will be loaded
     \arg \c source The path to the file the model is to be loaded from
+    \details If a journal written by ModelJournal belongs to the file it is replayed on top of it.
+    If a journal record can't be replayed the model is left empty and false is returned
     */
     bool loadModel(QAbstractItemModel* const model, const QString& source);
+    /*!
+    \brief Reads a model from a device
+    \arg \c model The model that will be loaded
+    \arg \c source The path to the file the model is to be loaded from
+    \arg \c options The options controlling the load
+    \details If a journal written by ModelJournal belongs to the file it is replayed on top of it.
+    If a journal record can't be replayed the model is left empty and false is returned
+    */
+    bool loadModel(QAbstractItemModel* const model, const QString& source, const LoadOptions& options);
+    /*!
+    \brief Saves the model to file without blocking the calling thread
+    \arg \c model The model to save
+    \arg \c destination The path to the file the model is to be saved to
+    \arg \c rolesToSave The roles in the model data that should be saved
+    \arg \c options The options controlling the output
+    \details Must be called from the thread of the model, whose event loop must be running for the future to finish.
+    The roles are copied from the model in slices of a few milliseconds run by the event loop, encoding and writing the copy run on the global QThreadPool.
+    If the model changes before the copy is complete, the copy is made again in one go once control returns to the event loop.
+    Cancelling the future stops the save and leaves the file untouched.
+    The observer of the options is called from the worker thread
+    */
+    QFuture<bool> saveModelAsync(const QAbstractItemModel* const model, const QString& destination, const QList<int>& rolesToSave, const SaveOptions& options);
+    /*!
+    \brief Saves the model to file without blocking the calling thread
+    \arg \c model The model to save
+    \arg \c destination The path to the file the model is to be saved to
+    \details All non-obsolete Qt::ItemDataRole will be saved
+    */
+    QFuture<bool> saveModelAsync(const QAbstractItemModel* const model, const QString& destination);
+    /*!
+    \brief Loads the model from file without blocking the thread of the model
+    \arg \c model The model that will be loaded
+    \arg \c source The path to the file the model is to be loaded from
+    \arg \c options The options controlling the load
+    \details Must be called from the thread of the model, whose event loop must be running for the future to finish.
+    The file is read on the global QThreadPool into a detached copy that is then applied to the model in slices of a few milliseconds.
+    The model is cleared when the first slice is applied and is left untouched if the file can't be read.
+    Cancelling the future stops the load: the model is left untouched while the file is read and empty once applying started.
+    bulkLoad is ignored and the observer is called from the worker thread
+    */
+    QFuture<bool> loadModelAsync(QAbstractItemModel* const model, const QString& source, const LoadOptions& options);
+    /*!
+    \brief Loads the model from file without blocking the thread of the model
+    \arg \c model The model that will be loaded
+    \arg \c source The path to the file the model is to be loaded from
+    */
+    QFuture<bool> loadModelAsync(QAbstractItemModel* const model, const QString& source);
+    /*!
+    \brief Loads a concrete model class through its own API instead of QModelIndex
+    \details loadModel uses the first registered adapter that handles the model.
+    The document is read into the cells made by createCells, the adapter then fills the model from them.
+    Header data is set through the model once setContent returned.
+    An adapter for QStandardItemModel is always registered, it handles that exact class and not its subclasses:
+    the document is read straight into detached items that are then moved into the model. Saving a model of that class reads its items directly
+    */
+    class ModelAdapter{
+    public:
+        virtual ~ModelAdapter() {}
+        /*!
+        \brief Returns true if the adapter loads the model, typically by checking its class
+        */
+        virtual bool handles(const QAbstractItemModel* model) const = 0;
+        /*!
+        \brief Creates the model the document is read into before setContent hands it to the model being loaded
+        \details The load deletes it once setContent returned. The default implementation returns an in-memory copy of the cells
+        whose calls are cheap and don't notify anything, adapters can return a detached instance of the model class to build its content directly
+        */
+        virtual QAbstractItemModel* createCells(const QAbstractItemModel* model) const;
+        /*!
+        \brief Fills the model that is being loaded
+        \arg \c model The model being loaded, it has already been cleared
+        \arg \c cells The model made by createCells holding the document, it is discarded afterwards so the adapter may take its content
+        \details Returning false makes the load fail and leaves the model empty
+        */
+        virtual bool setContent(QAbstractItemModel* model, QAbstractItemModel* cells) const = 0;
+    };
+    /*!
+    \brief Adds an adapter used for the models it handles, it takes precedence over the ones registered before
+    \details The adapter is not owned and must stay registered until every load using it has finished.
+    Adapters must be registered and unregistered while no load is running
+    */
+    void registerModelAdapter(ModelAdapter* adapter);
+    /*!
+    \brief Removes an adapter added by registerModelAdapter
+    */
+    void unregisterModelAdapter(ModelAdapter* adapter);
+    /*!
+    \brief Appends the text representing value to text
+    \details Returning false writes the value as a serialised payload instead
+    */
+    typedef bool (*ValueEncoder)(const QVariant& value, QString& text);
+    /*!
+    \brief Returns the value represented by text, a null QVariant if text is not valid
+    \details text refers to the characters of the document being read, copy them with QString(text.constData(), text.size()) to keep them
+    */
+    typedef QVariant (*ValueDecoder)(const QString& text);
+    /*!
+    \brief Sets how the xml format writes and reads the values of a type
+    \arg \c type The QMetaType id of the values
+    \arg \c encoder Converts values to text
+    \arg \c decoder Converts text back to values, passing a null encoder or decoder removes the codec of the type
+    \details Values of types without a codec are written as their QDataStream serialisation, compressed and encoded in hex or base64.
+    Codecs are built in for QColor, QBrush with a solid color, QFont, QSize, QSizeF, QRect, QPoint, Qt::Alignment, QByteArray and QStringList and can be replaced.
+    An encoder returning false keeps the serialised payload, the built in QFont codec does so for fonts its text can't describe.
+    They are not used with deduplicateValues or blobThreshold, which work on the serialised payloads, nor by the binary format.
+    The names of the user types with a codec are listed once at the start of each xml document, so their values still load in a run where the types got different ids.
+    Documents must be loaded with the same codecs they were saved with.
+    Codecs can be registered from any thread, a save or load running at the same time may use the codec from before or after the call
+    */
+    void registerValueCodec(int type, ValueEncoder encoder, ValueDecoder decoder);
+    /*!
+    \brief Proxy that loads the subtrees of a binary document only when they are requested
+    \details Only the top level of the document is read by loadModel.
+    Every other level is read from the source when a view calls fetchMore on its parent, typically when it gets expanded.
+    If a level can't be read, the rows already read are removed, the level can be fetched again and loadError is emitted.
+    Requires documents saved in BinaryFormat without deduplicateValues, compression, blobThreshold or columnarLayout
+    */
+    class LazyLoadProxyModel : public QIdentityProxyModel{
+        Q_OBJECT
+        Q_DISABLE_COPY(LazyLoadProxyModel)
+    public:
+        explicit LazyLoadProxyModel(QObject* parent = nullptr);
+        /*!
+        \brief Reads the top level of a model from a device
+        \arg \c model The model that will be loaded, it becomes the source model of the proxy
+        \arg \c source The device the model is to be read from
+        \details The device must be random access and must remain open as long as subtrees are still to be fetched
+        */
+        bool loadModel(QAbstractItemModel* const model, QIODevice* source);
+        /*!
+        \brief Reads the top level of a model from a file
+        \arg \c model The model that will be loaded, it becomes the source model of the proxy
+        \arg \c source The path to the file the model is to be loaded from
+        \details The file is kept open by the proxy
+        */
+        bool loadModel(QAbstractItemModel* const model, const QString& source);
+        bool hasChildren(const QModelIndex& parent = QModelIndex()) const Q_DECL_OVERRIDE;
+        bool canFetchMore(const QModelIndex& parent) const Q_DECL_OVERRIDE;
+        void fetchMore(const QModelIndex& parent) Q_DECL_OVERRIDE;
+    Q_SIGNALS:
+        /*!
+        \brief Emitted when fetchMore could not read the children of parent from the source
+        */
+        void loadError(const QModelIndex& parent);
+    private:
+        qint64 pendingSubtree(const QModelIndex& sourceIndex) const;
+        void invalidatePendingLookup();
+        QIODevice* m_source;
+        QIODevice* m_ownedSource;
+        qint32 m_minorVersion;
+        int m_valueStreamVersion;
+        QHash<QPersistentModelIndex, qint64> m_pendingSubtrees; /*!< Position in the source of the subtrees not read yet */
+        mutable QHash<QModelIndex, qint64> m_pendingLookup; /*!< m_pendingSubtrees by plain index, rebuilt after the structure of the model changed */
+        mutable bool m_pendingLookupValid;
+    };
+    /*!
+    \brief Records the changes made to a model in a journal next to its saved snapshot
+    \details The journal is written to the snapshot path followed by ".journal".
+    Changes are kept in memory until flush appends them to the journal, compact writes a new snapshot and empties the journal.
+    loadModel replays the journal on top of the snapshot when the model is loaded from the snapshot path.
+    Moves, layout changes and resets can't be recorded, the next flush compacts instead.
+    A record cut short by an interrupted append is ignored by loadModel and makes the next flush compact.
+    Create the journal after the model has been loaded so the load itself is not recorded
+    */
+    class ModelJournal : public QObject{
+        Q_OBJECT
+        Q_DISABLE_COPY(ModelJournal)
+    public:
+        /*!
+        \arg \c model The model whose changes are recorded
+        \arg \c snapshotPath The path to the file the model is saved to
+        \arg \c rolesToTrack The roles in the model data that should be saved
+        */
+        ModelJournal(QAbstractItemModel* model, const QString& snapshotPath, const QList<int>& rolesToTrack, QObject* parent = nullptr);
+        /*!
+        \arg \c model The model whose changes are recorded
+        \arg \c snapshotPath The path to the file the model is saved to
+        \details All non-obsolete Qt::ItemDataRole will be saved
+        */
+        ModelJournal(QAbstractItemModel* model, const QString& snapshotPath, QObject* parent = nullptr);
+        /*!
+        \brief The options used when compacting writes the snapshot
+        */
+        const SaveOptions& saveOptions() const;
+        void setSaveOptions(const SaveOptions& options);
+        /*!
+        \brief Whether there are changes that have not been written to disk yet
+        */
+        bool hasPendingChanges() const;
+        /*!
+        \brief Appends the pending changes to the journal
+        \details Compacts instead if the journal does not match the snapshot or a change could not be recorded
+        */
+        bool flush();
+        /*!
+        \brief Saves the whole model as the new snapshot and empties the journal
+        */
+        bool compact();
+    private:
+        bool journalIsCurrent();
+        void appendRecord(int recordType, const QByteArray& recordData);
+        void requireSnapshot();
+        void recordDataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles);
+        void recordRowsInserted(const QModelIndex& parent, int first, int last);
+        void recordColumnsInserted(const QModelIndex& parent, int first, int last);
+        void recordRowsRemoved(const QModelIndex& parent, int first, int last);
+        void recordColumnsRemoved(const QModelIndex& parent, int first, int last);
+        void recordRemoval(int recordType, const QModelIndex& parent, int first, int last);
+        void recordHeaderDataChanged(Qt::Orientation orientation, int first, int last);
+        QPointer<QAbstractItemModel> m_model;
+        QString m_snapshotPath;
+        QList<int> m_rolesToTrack;
+        SaveOptions m_saveOptions;
+        QByteArray m_pendingRecords; /*!< Records not yet appended to the journal */
+        bool m_requiresSnapshot;
+        bool m_journalVerified; /*!< The journal was found complete and only appended to by this object since */
+    };
 }
 #endif // modelserialisation_h__
\ No newline at end of file
@@ -0,0 +1,439 @@
+/*
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <QtTest>
+#include <QBrush>
+#include <QColor>
+#include <QFile>
+#include <QFont>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPixmap>
+#include <QStandardItemModel>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+#include "modelserialisation.h"
+
+namespace {
+    std::atomic<qint64> allocationCount(0);
+}
+
+#ifdef __GLIBC__
+// Counts every allocation of the process, including the ones Qt containers make with malloc instead of operator new
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* pointer, size_t size);
+    void* malloc(size_t size) noexcept
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t count, size_t size) noexcept
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+    void* realloc(void* pointer, size_t size) noexcept
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(pointer, size);
+    }
+}
+const bool allocationsCounted = true;
+#else
+const bool allocationsCounted = false;
+#endif
+
+namespace {
+    // Restarts the peak resident set size so it only covers what follows, the peak of the whole run is reported elsewhere
+    void resetPeakRss()
+    {
+#ifdef Q_OS_LINUX
+        QFile clearRefs(QStringLiteral("/proc/self/clear_refs"));
+        if (clearRefs.open(QIODevice::WriteOnly))
+            clearRefs.write("5");
+#endif
+    }
+
+    qint64 peakRss()
+    {
+#ifdef Q_OS_LINUX
+        QFile status(QStringLiteral("/proc/self/status"));
+        if (status.open(QIODevice::ReadOnly)) {
+            foreach(const QByteArray& line, status.readAll().split('\n'))
+            {
+                if (line.startsWith("VmHWM:"))
+                    return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+            }
+        }
+#endif
+#ifdef Q_OS_UNIX
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef Q_OS_DARWIN
+            return qint64(usage.ru_maxrss);
+#else
+            return qint64(usage.ru_maxrss) * 1024;
+#endif
+        }
+#endif
+        return -1;
+    }
+
+    struct Measurement
+    {
+        Measurement() : nsecs(0), allocations(-1), peakRss(-1) {}
+        qint64 nsecs;
+        qint64 allocations; // -1 where malloc can't be counted
+        qint64 peakRss; // -1 where it can't be read
+    };
+
+    Measurement measure(const std::function<void()>& operation)
+    {
+        Measurement result;
+        resetPeakRss();
+        const qint64 allocationsBefore = allocationCount.load();
+        QElapsedTimer timer;
+        timer.start();
+        operation();
+        result.nsecs = timer.nsecsElapsed();
+        if (allocationsCounted)
+            result.allocations = allocationCount.load() - allocationsBefore;
+        result.peakRss = peakRss();
+        return result;
+    }
+}
+
+// Saved and loaded through QModelIndex, the items of the exact QStandardItemModel class are read and built directly
+class IndexPathModel : public QStandardItemModel
+{
+    Q_OBJECT
+};
+
+class SerialisationBenchmark : public QObject
+{
+    Q_OBJECT
+private:
+    enum Shape
+    {
+        DenseTable, // Six roles in every cell
+        SparseTable, // A display role in one cell out of ten
+        PayloadTable, // Decoration, font and size hint in every cell
+        DeepTree, // 15 levels of 2x2 cells
+        WideTree // 1000x8 cells with 20x8 children below the first column
+    };
+    enum Configuration
+    {
+        XmlVersion1,
+        XmlVersion2,
+        Binary,
+        BinaryColumnar,
+        BinaryDeduplicated,
+        BinaryParallel,
+        XmlVersion2Zlib,
+        BinaryZlib
+    };
+    enum Path
+    {
+        ItemsPath,
+        IndexPath
+    };
+    static ModelSerialisation::SaveOptions saveOptions(int configuration)
+    {
+        ModelSerialisation::SaveOptions options;
+        options.format = ModelSerialisation::BinaryFormat;
+        switch (configuration) {
+        case XmlVersion1:
+            options.format = ModelSerialisation::XmlFormat;
+            break;
+        case XmlVersion2:
+        case XmlVersion2Zlib:
+            options.format = ModelSerialisation::XmlFormat;
+            options.xmlVersion = ModelSerialisation::XmlVersion2;
+            break;
+        case BinaryColumnar: options.columnarLayout = true; break;
+        case BinaryDeduplicated: options.deduplicateValues = true; break;
+        case BinaryParallel: options.parallelSave = true; break;
+        default:
+            break;
+        }
+        if (configuration == XmlVersion2Zlib || configuration == BinaryZlib)
+            options.compression = ModelSerialisation::ZlibCompression;
+        return options;
+    }
+    static const char* configurationName(int configuration)
+    {
+        static const char* const names[] = { "xml1", "xml2", "binary", "binary-columnar", "binary-dedup", "binary-parallel", "xml2-zlib", "binary-zlib" };
+        return names[configuration];
+    }
+    static const char* shapeName(int shape)
+    {
+        static const char* const names[] = { "dense-table", "sparse-table", "payload-table", "deep-tree", "wide-tree" };
+        return names[shape];
+    }
+    // MODELSERIALISATION_BENCH_MAX_CELLS raises the largest table from 10^6 cells up to 10^7
+    static qint64 maxCells()
+    {
+        bool ok;
+        const qint64 cells = qgetenv("MODELSERIALISATION_BENCH_MAX_CELLS").toLongLong(&ok);
+        return ok && cells > 0 ? cells : 1000000;
+    }
+    static QStandardItem* createItem(int shape, int row, int column)
+    {
+        static const QVector<QPixmap> pixmaps = []() {
+            QVector<QPixmap> result;
+            for (int i = 0; i < 16; ++i) {
+                QPixmap pixmap(32, 32);
+                pixmap.fill(QColor::fromHsv(i * 22, 200, 200));
+                result.append(pixmap);
+            }
+            return result;
+        }();
+        static const QVector<QFont> fonts = []() {
+            QVector<QFont> result;
+            for (int i = 0; i < 8; ++i) {
+                QFont font(i % 2 ? QStringLiteral("Sans") : QStringLiteral("Serif"), 8 + i);
+                font.setBold(i % 3 == 0);
+                font.setItalic(i % 4 == 1);
+                result.append(font);
+            }
+            return result;
+        }();
+        QStandardItem* item = nullptr;
+        switch (shape) {
+        case SparseTable:
+            if ((row * 7 + column) % 10 == 0)
+                item = new QStandardItem(QString::number(row * 10 + column));
+            break;
+        case PayloadTable:
+            item = new QStandardItem(QString::number(row));
+            item->setData(pixmaps.at((row + column) % pixmaps.size()), Qt::DecorationRole);
+            item->setData(fonts.at((row * 7 + column) % fonts.size()), Qt::FontRole);
+            item->setData(QSize(16 + row % 64, 20), Qt::SizeHintRole);
+            break;
+        default:
+            item = new QStandardItem(QStringLiteral("%1:%2").arg(row).arg(column));
+            item->setData(QStringLiteral("row %1").arg(row), Qt::ToolTipRole);
+            item->setData(int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
+            item->setData(QBrush(QColor::fromHsv(column * 30 % 360, 255, 128)), Qt::ForegroundRole);
+            item->setData(row * 10 + column, Qt::UserRole);
+            if (column == 0)
+                item->setData(int(row % 2 ? Qt::Checked : Qt::Unchecked), Qt::CheckStateRole);
+            break;
+        }
+        return item;
+    }
+    // Builds the rows below parent, the children of each row are built before the row is attached
+    static qint64 appendLevel(QStandardItem* parent, const QVector<int>& rowsPerLevel, int columns, int level)
+    {
+        qint64 cells = 0;
+        for (int i = 0; i < rowsPerLevel.at(level); ++i) {
+            QList<QStandardItem*> row;
+            for (int j = 0; j < columns; ++j)
+                row.append(createItem(DenseTable, i, j));
+            cells += columns;
+            if (level + 1 < rowsPerLevel.size())
+                cells += appendLevel(row.first(), rowsPerLevel, columns, level + 1);
+            parent->appendRow(row);
+        }
+        return cells;
+    }
+    static qint64 fillModel(QStandardItemModel& model, int shape, qint64 cells)
+    {
+        switch (shape) {
+        case DeepTree:
+            return appendLevel(model.invisibleRootItem(), QVector<int>(15, 2), 2, 0);
+        case WideTree:
+            return appendLevel(model.invisibleRootItem(), QVector<int>() << 1000 << 20, 8, 0);
+        default:
+            break;
+        }
+        const int columns = 10;
+        const int rows = int(cells / columns);
+        model.setColumnCount(columns);
+        model.setRowCount(rows);
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < columns; ++j) {
+                if (QStandardItem* const item = createItem(shape, i, j))
+                    model.setItem(i, j, item);
+            }
+        }
+        return qint64(rows) * columns;
+    }
+    static QStandardItemModel* createModel(int path)
+    {
+        return path == IndexPath ? new IndexPathModel : new QStandardItemModel;
+    }
+    // Consecutive rows only differ by their configuration so the model is built once for all of them
+    const QStandardItemModel& sourceModel(int shape, qint64 cells, int path)
+    {
+        const QString key = QStringLiteral("%1/%2/%3").arg(shape).arg(cells).arg(path);
+        if (key != m_sourceKey) {
+            m_source.reset();
+            m_source.reset(createModel(path));
+            m_sourceCells = fillModel(*m_source, shape, cells);
+            m_sourceKey = key;
+        }
+        return *m_source;
+    }
+    void addRows()
+    {
+        QTest::addColumn<int>("shape");
+        QTest::addColumn<qint64>("cells");
+        QTest::addColumn<int>("path");
+        QTest::addColumn<int>("configuration");
+        const qint64 largestTable = qMin<qint64>(maxCells(), 10000000);
+        QVector<QPair<int, qint64> > models;
+        for (qint64 cells = 10000; cells <= largestTable; cells *= 10) {
+            models.append(qMakePair(int(DenseTable), cells));
+            models.append(qMakePair(int(SparseTable), cells));
+            if (cells <= 100000) // Every cell decodes its own pixmap
+                models.append(qMakePair(int(PayloadTable), cells));
+        }
+        if (largestTable >= 100000) {
+            models.append(qMakePair(int(DeepTree), qint64(0)));
+            models.append(qMakePair(int(WideTree), qint64(0)));
+        }
+        for (const QPair<int, qint64>& model : models) {
+            for (int path = ItemsPath; path <= IndexPath; ++path) {
+                for (int configuration = XmlVersion1; configuration <= BinaryZlib; ++configuration) {
+                    if (configuration == BinaryColumnar && (model.first == DeepTree || model.first == WideTree))
+                        continue; // Only flat tables are stored in columns
+                    const QString tag = QStringLiteral("%1 %2/%3/%4")
+                        .arg(QLatin1String(shapeName(model.first)))
+                        .arg(model.second > 0 ? QString::number(model.second) : QStringLiteral("fixed"))
+                        .arg(QLatin1String(path == IndexPath ? "index" : "items"))
+                        .arg(QLatin1String(configurationName(configuration)));
+                    QTest::newRow(qPrintable(tag)) << model.first << model.second << path << configuration;
+                }
+            }
+        }
+    }
+    // One json object per line so runs can be appended to the same file and compared over time
+    void report(qint64 cells, qint64 bytes, const Measurement& measurement)
+    {
+        const double seconds = measurement.nsecs / 1e9;
+        QJsonObject result;
+        result.insert(QStringLiteral("benchmark"), QLatin1String(QTest::currentTestFunction()));
+        result.insert(QStringLiteral("case"), QLatin1String(QTest::currentDataTag()));
+        result.insert(QStringLiteral("qtVersion"), QLatin1String(qVersion()));
+        result.insert(QStringLiteral("timestamp"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+        result.insert(QStringLiteral("cells"), double(cells));
+        result.insert(QStringLiteral("bytes"), double(bytes));
+        result.insert(QStringLiteral("bytesPerCell"), cells > 0 ? double(bytes) / cells : 0.0);
+        result.insert(QStringLiteral("nsecs"), double(measurement.nsecs));
+        result.insert(QStringLiteral("cellsPerSecond"), seconds > 0 ? cells / seconds : 0.0);
+        result.insert(QStringLiteral("allocations"), double(measurement.allocations));
+        result.insert(QStringLiteral("allocationsPerCell"), measurement.allocations >= 0 && cells > 0 ? double(measurement.allocations) / cells : -1.0);
+        result.insert(QStringLiteral("peakRssBytes"), double(measurement.peakRss));
+        m_output.write(QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n');
+        m_output.flush();
+        qInfo("%.0f cells/s, %.2f bytes/cell, %lld allocations, peak RSS %lld KiB",
+            seconds > 0 ? cells / seconds : 0.0, cells > 0 ? double(bytes) / cells : 0.0,
+            measurement.allocations, measurement.peakRss >= 0 ? measurement.peakRss / 1024 : -1);
+    }
+    QScopedPointer<QStandardItemModel> m_source;
+    QString m_sourceKey;
+    qint64 m_sourceCells;
+    QFile m_output;
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QString outputPath = QString::fromLocal8Bit(qgetenv("MODELSERIALISATION_BENCH_OUTPUT"));
+        if (outputPath.isEmpty())
+            outputPath = QStringLiteral("modelserialisation_bench.jsonl");
+        m_output.setFileName(outputPath);
+        QVERIFY2(m_output.open(QIODevice::WriteOnly | QIODevice::Append), qPrintable(m_output.errorString()));
+        m_sourceCells = 0;
+    }
+    void cleanupTestCase()
+    {
+        m_source.reset();
+        qInfo("Peak RSS of the run: %lld KiB", peakRss() / 1024);
+    }
+    void save_data()
+    {
+        addRows();
+    }
+    void save()
+    {
+        QFETCH(int, shape);
+        QFETCH(qint64, cells);
+        QFETCH(int, path);
+        QFETCH(int, configuration);
+        const QStandardItemModel& model = sourceModel(shape, cells, path);
+        const ModelSerialisation::SaveOptions options = saveOptions(configuration);
+        QByteArray data;
+        bool saved = false;
+        Measurement measurement;
+        QBENCHMARK_ONCE {
+            measurement = measure([&]() {
+                QBuffer buffer(&data);
+                buffer.open(QIODevice::WriteOnly);
+                saved = ModelSerialisation::saveModel(&model, &buffer, ModelSerialisation::modelDefaultRoles(), options);
+            });
+        }
+        if (!saved && options.compression != ModelSerialisation::NoCompression)
+            QSKIP("The library was built without this compression");
+        QVERIFY(saved);
+        report(m_sourceCells, data.size(), measurement);
+    }
+    void load_data()
+    {
+        addRows();
+    }
+    void load()
+    {
+        QFETCH(int, shape);
+        QFETCH(qint64, cells);
+        QFETCH(int, path);
+        QFETCH(int, configuration);
+        const QStandardItemModel& model = sourceModel(shape, cells, path);
+        const ModelSerialisation::SaveOptions options = saveOptions(configuration);
+        QByteArray data;
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        if (!ModelSerialisation::saveModel(&model, &buffer, ModelSerialisation::modelDefaultRoles(), options)) {
+            if (options.compression != ModelSerialisation::NoCompression)
+                QSKIP("The library was built without this compression");
+            QFAIL("The model could not be saved");
+        }
+        buffer.close();
+        QScopedPointer<QStandardItemModel> loadedModel(createModel(path));
+        bool loaded = false;
+        Measurement measurement;
+        QBENCHMARK_ONCE {
+            measurement = measure([&]() {
+                buffer.open(QIODevice::ReadOnly);
+                loaded = ModelSerialisation::loadModel(loadedModel.data(), &buffer);
+                buffer.close();
+            });
+        }
+        QVERIFY(loaded);
+        report(m_sourceCells, data.size(), measurement);
+    }
+};
+
+QTEST_MAIN(SerialisationBenchmark)
+#include "bench_modelserialisation.moc"
@@ -0,0 +1,825 @@
+/*
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <QtTest>
+#include <QAbstractItemModelTester>
+#include <QBrush>
+#include <QColor>
+#include <QFont>
+#include <QIcon>
+#include <QPixmap>
+#include <QSortFilterProxyModel>
+#include <QStandardItemModel>
+#include "modelserialisation.h"
+
+// Goes through QModelIndex instead of the items since it is not exactly a QStandardItemModel
+class DerivedItemModel : public QStandardItemModel
+{
+    Q_OBJECT
+};
+
+// Answers a role from data() that none of its items holds
+class ComputedItemModel : public DerivedItemModel
+{
+public:
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override
+    {
+        if (role == Qt::WhatsThisRole && index.isValid())
+            return QStringLiteral("computed %1.%2").arg(index.row()).arg(index.column());
+        return QStandardItemModel::data(index, role);
+    }
+};
+
+// Refuses the value the rejectedJournalRecord test writes to the journal
+class RejectingItemModel : public DerivedItemModel
+{
+public:
+    bool setItemData(const QModelIndex& index, const QMap<int, QVariant>& roles) override
+    {
+        foreach(const QVariant& value, roles)
+        {
+            if (value == QVariant(QStringLiteral("rejected")))
+                return false;
+        }
+        return QStandardItemModel::setItemData(index, roles);
+    }
+};
+
+// Records what a save or a load reports, cancels it after cancelAfter progress reports unless it is negative
+class RecordingObserver : public ModelSerialisation::SerialisationObserver
+{
+public:
+    explicit RecordingObserver(int cancelAfter = -1)
+        : progressCount(0), finishedCount(0), m_cancelAfter(cancelAfter)
+    {}
+    void progress(const ModelSerialisation::SerialisationStatistics& statistics) override
+    {
+        ++progressCount;
+        lastStatistics = statistics;
+    }
+    void finished(const ModelSerialisation::SerialisationStatistics& statistics) override
+    {
+        ++finishedCount;
+        lastStatistics = statistics;
+    }
+    bool isCancelled() override
+    {
+        return m_cancelAfter >= 0 && progressCount > m_cancelAfter;
+    }
+    int progressCount;
+    int finishedCount;
+    ModelSerialisation::SerialisationStatistics lastStatistics;
+private:
+    int m_cancelAfter;
+};
+
+// A user type written as text by a codec registered in the userTypeCodec test
+struct TestPoint
+{
+    int x;
+    int y;
+    bool operator==(const TestPoint& other) const
+    {
+        return x == other.x && y == other.y;
+    }
+};
+Q_DECLARE_METATYPE(TestPoint)
+
+static bool encodeTestPoint(const QVariant& value, QString& text)
+{
+    const TestPoint point = value.value<TestPoint>();
+    text += QStringLiteral("%1,%2").arg(point.x).arg(point.y);
+    return true;
+}
+
+static QVariant decodeTestPoint(const QString& text)
+{
+    const int separator = text.indexOf(QLatin1Char(','));
+    if (separator < 0)
+        return QVariant();
+    TestPoint point;
+    point.x = text.left(separator).toInt();
+    point.y = text.mid(separator + 1).toInt();
+    return QVariant::fromValue(point);
+}
+
+class ModelSerialisationTest : public QObject
+{
+    Q_OBJECT
+private:
+    static QList<int> testRoles()
+    {
+        return ModelSerialisation::modelDefaultRoles() << Qt::DisplayRole << (Qt::UserRole + 1);
+    }
+    // A tree mixing every kind of value the formats handle, some cells are left empty
+    static void fillTree(QStandardItemModel& model)
+    {
+        QPixmap bluePix(16, 16);
+        bluePix.fill(Qt::blue);
+        QFont spacedFont(QStringLiteral("Sans"), 11);
+        spacedFont.setBold(true);
+        spacedFont.setLetterSpacing(QFont::AbsoluteSpacing, 1.5); // Not part of QFont::toString on Qt 5
+        model.clear();
+        model.setRowCount(4);
+        model.setColumnCount(3);
+        for (int i = 0; i < model.rowCount(); ++i) {
+            model.setHeaderData(i, Qt::Vertical, QStringLiteral("Row %1").arg(i));
+            for (int j = 0; j < model.columnCount(); ++j) {
+                if (i == 3 && j > 0)
+                    continue; // Empty cells
+                const QModelIndex cell = model.index(i, j);
+                model.setData(cell, QStringLiteral("%1.%2 <&>\"").arg(i).arg(j));
+                model.setData(cell, QStringLiteral("tip %1").arg(i * 3 + j), Qt::ToolTipRole);
+                model.setData(cell, i * 100 + j, Qt::UserRole);
+            }
+        }
+        for (int j = 0; j < model.columnCount(); ++j)
+            model.setHeaderData(j, Qt::Horizontal, QStringLiteral("Column %1").arg(j));
+        model.setHeaderData(0, Qt::Horizontal, QColor(Qt::red), Qt::ForegroundRole);
+        model.setData(model.index(0, 0), QIcon(bluePix), Qt::DecorationRole);
+        model.setData(model.index(0, 1), bluePix, Qt::DecorationRole);
+        model.setData(model.index(0, 2), QColor(10, 20, 30, 40), Qt::DecorationRole);
+        model.setData(model.index(1, 0), spacedFont, Qt::FontRole);
+        model.setData(model.index(1, 1), QFont(QStringLiteral("Serif"), 9), Qt::FontRole);
+        model.setData(model.index(1, 2), QSize(48, 20), Qt::SizeHintRole);
+        model.setData(model.index(2, 0), QBrush(Qt::yellow), Qt::BackgroundRole);
+        model.setData(model.index(2, 1), int(Qt::AlignRight | Qt::AlignVCenter), Qt::TextAlignmentRole);
+        model.setData(model.index(2, 2), int(Qt::Checked), Qt::CheckStateRole);
+        model.setData(model.index(2, 0), QByteArray("\0raw\xff", 5), Qt::UserRole + 1);
+        model.setData(model.index(2, 1), QStringList() << QStringLiteral("a,b") << QString(), Qt::UserRole + 1);
+        model.setData(model.index(2, 2), QDateTime(QDate(2020, 2, 29), QTime(12, 30)), Qt::UserRole + 1);
+        model.setData(model.index(3, 0), 2.5, Qt::UserRole + 1);
+        // Children on two levels, one of them with no values at all
+        const QModelIndex parent = model.index(0, 0);
+        model.insertRows(0, 3, parent);
+        model.insertColumns(0, 2, parent);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 2; ++j)
+                model.setData(model.index(i, j, parent), QStringLiteral("child %1.%2").arg(i).arg(j));
+        }
+        const QModelIndex grandParent = model.index(1, 1, parent);
+        model.insertRows(0, 2, grandParent);
+        model.insertColumns(0, 1, grandParent);
+        model.setData(model.index(1, 0, grandParent), QStringLiteral("grandchild"));
+        model.setData(model.index(1, 0, grandParent), QColor(Qt::green), Qt::ForegroundRole);
+        const QModelIndex emptyParent = model.index(2, 1);
+        model.insertRows(0, 1, emptyParent);
+        model.insertColumns(0, 1, emptyParent);
+    }
+    // A table with no children, the only kind the columnar layout stores
+    static void fillTable(QStandardItemModel& model, int rows, int columns)
+    {
+        model.clear();
+        model.setRowCount(rows);
+        model.setColumnCount(columns);
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < columns; ++j) {
+                if ((i + j) % 7 == 3)
+                    continue;
+                const QModelIndex cell = model.index(i, j);
+                switch (j % 4) {
+                case 0: model.setData(cell, i * columns + j); break;
+                case 1: model.setData(cell, QStringLiteral("text %1").arg(i)); break;
+                case 2: model.setData(cell, i / 3.0); break;
+                default: model.setData(cell, QColor(i % 256, j % 256, 0), Qt::BackgroundRole); break;
+                }
+                if (i % 5 == 0)
+                    model.setData(cell, QSize(i, j), Qt::SizeHintRole);
+            }
+        }
+    }
+    static void compareValues(const QVariant& actual, const QVariant& expected)
+    {
+        QCOMPARE(actual.userType(), expected.userType());
+        // QPixmap and QIcon have no equality, their images are compared instead
+        if (expected.userType() == QMetaType::QPixmap)
+            QCOMPARE(actual.value<QPixmap>().toImage(), expected.value<QPixmap>().toImage());
+        else if (expected.userType() == QMetaType::QIcon)
+            QCOMPARE(actual.value<QIcon>().pixmap(16, 16).toImage(), expected.value<QIcon>().pixmap(16, 16).toImage());
+        else
+            QCOMPARE(actual, expected);
+    }
+    static void compareLevel(const QAbstractItemModel& actual, const QModelIndex& actualParent, const QAbstractItemModel& expected, const QModelIndex& expectedParent, const QList<int>& roles)
+    {
+        QCOMPARE(actual.rowCount(actualParent), expected.rowCount(expectedParent));
+        QCOMPARE(actual.columnCount(actualParent), expected.columnCount(expectedParent));
+        for (int i = 0; i < expected.rowCount(expectedParent); ++i) {
+            for (int j = 0; j < expected.columnCount(expectedParent); ++j) {
+                const QModelIndex actualIndex = actual.index(i, j, actualParent);
+                const QModelIndex expectedIndex = expected.index(i, j, expectedParent);
+                foreach(int role, roles)
+                {
+                    compareValues(actual.data(actualIndex, role), expected.data(expectedIndex, role));
+                    if (QTest::currentTestFailed()) {
+                        qWarning("Cell %d,%d role %d differs", i, j, role);
+                        return;
+                    }
+                }
+                compareLevel(actual, actualIndex, expected, expectedIndex, roles);
+                if (QTest::currentTestFailed())
+                    return;
+            }
+        }
+    }
+    static void compareModels(const QAbstractItemModel& actual, const QAbstractItemModel& expected, const QList<int>& roles)
+    {
+        compareLevel(actual, QModelIndex(), expected, QModelIndex(), roles);
+        if (QTest::currentTestFailed())
+            return;
+        foreach(int role, roles)
+        {
+            for (int i = 0; i < expected.columnCount(); ++i)
+                compareValues(actual.headerData(i, Qt::Horizontal, role), expected.headerData(i, Qt::Horizontal, role));
+            for (int i = 0; i < expected.rowCount(); ++i)
+                compareValues(actual.headerData(i, Qt::Vertical, role), expected.headerData(i, Qt::Vertical, role));
+        }
+    }
+    static QByteArray saveToBuffer(const QAbstractItemModel& model, const ModelSerialisation::SaveOptions& options)
+    {
+        QByteArray data;
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        if (!ModelSerialisation::saveModel(&model, &buffer, testRoles(), options))
+            data.clear();
+        return data;
+    }
+    static bool loadFromBuffer(QAbstractItemModel& model, QByteArray data, const ModelSerialisation::LoadOptions& options = ModelSerialisation::LoadOptions())
+    {
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::ReadOnly);
+        return ModelSerialisation::loadModel(&model, &buffer, options);
+    }
+    QTemporaryDir m_directory;
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QVERIFY(m_directory.isValid());
+    }
+    void roundTrip_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::addColumn<int>("xmlVersion");
+        QTest::addColumn<int>("payloadEncoding");
+        QTest::addColumn<bool>("deduplicateValues");
+        QTest::addColumn<bool>("parallelSave");
+        QTest::newRow("xml v1") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::HexPayload) << false << false;
+        QTest::newRow("xml v1 base64") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::Base64Payload) << false << false;
+        QTest::newRow("xml v2") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << int(ModelSerialisation::HexPayload) << false << false;
+        QTest::newRow("xml v2 base64") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << int(ModelSerialisation::Base64Payload) << false << false;
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::HexPayload) << false << false;
+        QTest::newRow("xml v1 deduplicated") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::HexPayload) << true << false;
+        QTest::newRow("xml v2 deduplicated") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << int(ModelSerialisation::Base64Payload) << true << false;
+        QTest::newRow("binary deduplicated") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::HexPayload) << true << false;
+        QTest::newRow("xml v2 parallel") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << int(ModelSerialisation::HexPayload) << false << true;
+        QTest::newRow("binary parallel") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1) << int(ModelSerialisation::HexPayload) << false << true;
+    }
+    void roundTrip()
+    {
+        QFETCH(int, format);
+        QFETCH(int, xmlVersion);
+        QFETCH(int, payloadEncoding);
+        QFETCH(bool, deduplicateValues);
+        QFETCH(bool, parallelSave);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        options.xmlVersion = static_cast<ModelSerialisation::XmlVersion>(xmlVersion);
+        options.payloadEncoding = static_cast<ModelSerialisation::PayloadEncoding>(payloadEncoding);
+        options.deduplicateValues = deduplicateValues;
+        options.parallelSave = parallelSave;
+        const QByteArray data = saveToBuffer(model, options);
+        QVERIFY(!data.isEmpty());
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, data));
+        compareModels(loadedModel, model, testRoles());
+        // The generic QModelIndex path must read the same document
+        DerivedItemModel derivedModel;
+        QVERIFY(loadFromBuffer(derivedModel, data));
+        compareModels(derivedModel, model, testRoles());
+        // The loaded model saves what it was loaded from
+        QStandardItemModel reloadedModel;
+        QVERIFY(loadFromBuffer(reloadedModel, saveToBuffer(loadedModel, options)));
+        compareModels(reloadedModel, model, testRoles());
+    }
+    void parallelSaveIdentical_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::addColumn<int>("xmlVersion");
+        QTest::addColumn<bool>("table");
+        QTest::newRow("xml v1 tree") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1) << false;
+        QTest::newRow("xml v1 table") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1) << true;
+        QTest::newRow("xml v2 tree") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << false;
+        QTest::newRow("xml v2 table") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2) << true;
+        QTest::newRow("binary tree") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1) << false;
+        QTest::newRow("binary table") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1) << true;
+    }
+    void parallelSaveIdentical()
+    {
+        QFETCH(int, format);
+        QFETCH(int, xmlVersion);
+        QFETCH(bool, table);
+        QStandardItemModel model;
+        if (table)
+            fillTable(model, 200, 5);
+        else
+            fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        options.xmlVersion = static_cast<ModelSerialisation::XmlVersion>(xmlVersion);
+        const QByteArray serialData = saveToBuffer(model, options);
+        QVERIFY(!serialData.isEmpty());
+        options.parallelSave = true;
+        QCOMPARE(saveToBuffer(model, options), serialData);
+        // Through QModelIndex as well as through the items
+        DerivedItemModel derivedModel;
+        QVERIFY(loadFromBuffer(derivedModel, serialData));
+        options.parallelSave = false;
+        const QByteArray derivedSerialData = saveToBuffer(derivedModel, options);
+        QVERIFY(!derivedSerialData.isEmpty());
+        options.parallelSave = true;
+        QCOMPARE(saveToBuffer(derivedModel, options), derivedSerialData);
+    }
+    void useItemData_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::newRow("xml") << int(ModelSerialisation::XmlFormat);
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat);
+    }
+    void useItemData()
+    {
+        QFETCH(int, format);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        DerivedItemModel derivedModel;
+        QVERIFY(loadFromBuffer(derivedModel, saveToBuffer(model, options)));
+        QVERIFY(testRoles().contains(Qt::EditRole));
+        const QByteArray dataPerRole = saveToBuffer(derivedModel, options);
+        QVERIFY(!dataPerRole.isEmpty());
+        options.useItemData = true;
+        QCOMPARE(saveToBuffer(derivedModel, options), dataPerRole);
+    }
+    void emptyCellsStayEmpty()
+    {
+        QStandardItemModel model;
+        fillTree(model);
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, saveToBuffer(model, ModelSerialisation::SaveOptions())));
+        QVERIFY(!loadedModel.item(3, 1));
+        QVERIFY(loadedModel.item(2, 1));
+        QCOMPARE(loadedModel.item(2, 1)->rowCount(), 1);
+        QVERIFY(!loadedModel.item(2, 1)->child(0, 0));
+    }
+    void standardItemModelNotifications()
+    {
+        QStandardItemModel model;
+        fillTree(model);
+        const QByteArray data = saveToBuffer(model, ModelSerialisation::SaveOptions());
+        QStandardItemModel loadedModel;
+        QAbstractItemModelTester tester(&loadedModel, QAbstractItemModelTester::FailureReportingMode::QtTest);
+        QSignalSpy dataChangedSpy(&loadedModel, &QAbstractItemModel::dataChanged);
+        QSignalSpy layoutSpy(&loadedModel, &QAbstractItemModel::layoutChanged);
+        QVERIFY(loadFromBuffer(loadedModel, data));
+        compareModels(loadedModel, model, testRoles());
+        // The items arrive together as a change of the data of the top level
+        QCOMPARE(dataChangedSpy.count(), 1);
+        QCOMPARE(layoutSpy.count(), 0);
+    }
+    void derivedModelSavesThroughData()
+    {
+        ComputedItemModel model;
+        fillTree(model);
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, saveToBuffer(model, ModelSerialisation::SaveOptions())));
+        QCOMPARE(loadedModel.data(loadedModel.index(1, 2), Qt::WhatsThisRole).toString(), QStringLiteral("computed 1.2"));
+    }
+    void compression_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::addColumn<int>("compression");
+        QTest::newRow("xml zlib") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::ZlibCompression);
+        QTest::newRow("binary zlib") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::ZlibCompression);
+        QTest::newRow("xml zstd") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::ZstdCompression);
+        QTest::newRow("binary zstd") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::ZstdCompression);
+    }
+    void compression()
+    {
+        QFETCH(int, format);
+        QFETCH(int, compression);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        options.xmlVersion = ModelSerialisation::XmlVersion2;
+        options.compression = static_cast<ModelSerialisation::StreamCompression>(compression);
+        const QByteArray data = saveToBuffer(model, options);
+        if (data.isEmpty())
+            QSKIP("The library was built without this compression");
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, data));
+        compareModels(loadedModel, model, testRoles());
+    }
+    void blobs_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::newRow("xml") << int(ModelSerialisation::XmlFormat);
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat);
+    }
+    void blobs()
+    {
+        QFETCH(int, format);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        options.blobThreshold = 16;
+        const QString name = QStringLiteral("blobs%1").arg(format);
+        const QString path = m_directory.filePath(name);
+        const QDir directory(m_directory.path());
+        const QStringList blobFilter(name + QStringLiteral(".*.blobs"));
+        QVERIFY(ModelSerialisation::saveModel(&model, path, testRoles(), options));
+        const QStringList firstBlobFiles = directory.entryList(blobFilter);
+        QCOMPARE(firstBlobFiles.size(), 1);
+        QVERIFY(QFileInfo(directory.filePath(firstBlobFiles.first())).size() > 0);
+        // Saving again writes a new blob file and removes the one the replaced document referred to
+        QVERIFY(ModelSerialisation::saveModel(&model, path, testRoles(), options));
+        const QStringList secondBlobFiles = directory.entryList(blobFilter);
+        QCOMPARE(secondBlobFiles.size(), 1);
+        QVERIFY(secondBlobFiles.first() != firstBlobFiles.first());
+        QStandardItemModel loadedModel;
+        QVERIFY(ModelSerialisation::loadModel(&loadedModel, path));
+        compareModels(loadedModel, model, testRoles());
+        // A document saved without blobs needs no blob file
+        options.blobThreshold = 0;
+        QVERIFY(ModelSerialisation::saveModel(&model, path, testRoles(), options));
+        QVERIFY(directory.entryList(blobFilter).isEmpty());
+        QStandardItemModel plainModel;
+        QVERIFY(ModelSerialisation::loadModel(&plainModel, path));
+        compareModels(plainModel, model, testRoles());
+    }
+    void userTypeCodec_data()
+    {
+        QTest::addColumn<int>("xmlVersion");
+        QTest::newRow("xml v1") << int(ModelSerialisation::XmlVersion1);
+        QTest::newRow("xml v2") << int(ModelSerialisation::XmlVersion2);
+    }
+    void userTypeCodec()
+    {
+        QFETCH(int, xmlVersion);
+        const int pointType = qMetaTypeId<TestPoint>();
+        ModelSerialisation::registerValueCodec(pointType, encodeTestPoint, decodeTestPoint);
+        QStandardItemModel model;
+        model.setRowCount(3);
+        model.setColumnCount(2);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                const TestPoint point = { i, j };
+                model.setData(model.index(i, j), QVariant::fromValue(point), Qt::UserRole + 1);
+            }
+        }
+        ModelSerialisation::SaveOptions options;
+        options.xmlVersion = static_cast<ModelSerialisation::XmlVersion>(xmlVersion);
+        const QByteArray data = saveToBuffer(model, options);
+        QVERIFY(!data.isEmpty());
+        // The name of the type is written once for the whole document instead of once per value
+        QCOMPARE(data.count("TestPoint"), 1);
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, data));
+        ModelSerialisation::registerValueCodec(pointType, nullptr, nullptr);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                const QVariant value = loadedModel.data(loadedModel.index(i, j), Qt::UserRole + 1);
+                QCOMPARE(value.userType(), pointType);
+                const TestPoint point = { i, j };
+                QVERIFY(value.value<TestPoint>() == point);
+            }
+        }
+    }
+    void bulkLoad_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::addColumn<int>("xmlVersion");
+        QTest::newRow("xml v1") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1);
+        QTest::newRow("xml v2") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2);
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1);
+    }
+    void bulkLoad()
+    {
+        QFETCH(int, format);
+        QFETCH(int, xmlVersion);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions saveOptions;
+        saveOptions.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        saveOptions.xmlVersion = static_cast<ModelSerialisation::XmlVersion>(xmlVersion);
+        const QByteArray data = saveToBuffer(model, saveOptions);
+        QVERIFY(!data.isEmpty());
+        DerivedItemModel loadedModel;
+        QAbstractItemModelTester tester(&loadedModel, QAbstractItemModelTester::FailureReportingMode::QtTest);
+        // The filter only accepts the row once its values are notified
+        QSortFilterProxyModel proxy;
+        proxy.setSourceModel(&loadedModel);
+        proxy.setFilterFixedString(QStringLiteral("1.0"));
+        QCOMPARE(proxy.rowCount(), 0);
+        QSignalSpy dataChangedSpy(&loadedModel, &QAbstractItemModel::dataChanged);
+        QSignalSpy headerSpy(&loadedModel, &QAbstractItemModel::headerDataChanged);
+        ModelSerialisation::LoadOptions options;
+        options.bulkLoad = true;
+        QVERIFY(loadFromBuffer(loadedModel, data, options));
+        compareModels(loadedModel, model, testRoles());
+        // One notification per level: the top level, the children of 0,0, the grandchildren below them and the empty table of 2,1
+        QCOMPARE(dataChangedSpy.count(), 4);
+        QCOMPARE(headerSpy.count(), 2);
+        QCOMPARE(proxy.rowCount(), 1);
+        QCOMPARE(proxy.data(proxy.index(0, 0)), model.data(model.index(1, 0)));
+    }
+    void columnar()
+    {
+        QStandardItemModel model;
+        fillTable(model, 300, 9);
+        ModelSerialisation::SaveOptions options;
+        options.format = ModelSerialisation::BinaryFormat;
+        options.columnarLayout = true;
+        const QByteArray data = saveToBuffer(model, options);
+        QVERIFY(!data.isEmpty());
+        options.columnarLayout = false;
+        QVERIFY(data != saveToBuffer(model, options));
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, data));
+        compareModels(loadedModel, model, testRoles());
+    }
+    void query_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::newRow("xml v1") << int(ModelSerialisation::XmlFormat);
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat);
+    }
+    void query()
+    {
+        QFETCH(int, format);
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions saveOptions;
+        saveOptions.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        const QByteArray data = saveToBuffer(model, saveOptions);
+        QVERIFY(!data.isEmpty());
+        {
+            ModelSerialisation::LoadOptions options;
+            options.query.roles << Qt::DisplayRole;
+            QStandardItemModel loadedModel;
+            QVERIFY(loadFromBuffer(loadedModel, data, options));
+            compareLevel(loadedModel, QModelIndex(), model, QModelIndex(), QList<int>() << Qt::DisplayRole);
+            QVERIFY(!loadedModel.data(loadedModel.index(0, 0), Qt::ToolTipRole).isValid());
+        }
+        {
+            ModelSerialisation::LoadOptions options;
+            options.query.subtreePath << qMakePair(0, 0);
+            QStandardItemModel loadedModel;
+            QVERIFY(loadFromBuffer(loadedModel, data, options));
+            compareLevel(loadedModel, QModelIndex(), model, model.index(0, 0), testRoles());
+        }
+        {
+            ModelSerialisation::LoadOptions options;
+            options.query.firstRow = 1;
+            options.query.lastRow = 2;
+            options.query.maxDepth = 0;
+            QStandardItemModel loadedModel;
+            QVERIFY(loadFromBuffer(loadedModel, data, options));
+            QCOMPARE(loadedModel.rowCount(), 2);
+            QCOMPARE(loadedModel.data(loadedModel.index(0, 0)), model.data(model.index(1, 0)));
+            QCOMPARE(loadedModel.data(loadedModel.index(1, 2)), model.data(model.index(2, 2)));
+            QVERIFY(!loadedModel.hasChildren(loadedModel.index(1, 1)));
+        }
+    }
+    void observer_data()
+    {
+        QTest::addColumn<int>("format");
+        QTest::addColumn<int>("xmlVersion");
+        QTest::newRow("xml v1") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion1);
+        QTest::newRow("xml v2") << int(ModelSerialisation::XmlFormat) << int(ModelSerialisation::XmlVersion2);
+        QTest::newRow("binary") << int(ModelSerialisation::BinaryFormat) << int(ModelSerialisation::XmlVersion1);
+    }
+    void observer()
+    {
+        QFETCH(int, format);
+        QFETCH(int, xmlVersion);
+        const qint64 cellCount = 300 * 9;
+        QStandardItemModel model;
+        fillTable(model, 300, 9);
+        ModelSerialisation::SaveOptions options;
+        options.format = static_cast<ModelSerialisation::SerialisationFormat>(format);
+        options.xmlVersion = static_cast<ModelSerialisation::XmlVersion>(xmlVersion);
+        RecordingObserver saveObserver;
+        options.observer = &saveObserver;
+        const QByteArray data = saveToBuffer(model, options);
+        QVERIFY(!data.isEmpty());
+        QVERIFY(saveObserver.progressCount > 0);
+        QCOMPARE(saveObserver.finishedCount, 1);
+        QCOMPARE(saveObserver.lastStatistics.cellsProcessed, cellCount);
+        QCOMPARE(saveObserver.lastStatistics.cellsTotal, cellCount);
+        QVERIFY(saveObserver.lastStatistics.types.contains(QMetaType::QString));
+        ModelSerialisation::LoadOptions loadOptions;
+        RecordingObserver loadObserver;
+        loadOptions.observer = &loadObserver;
+        QStandardItemModel loadedModel;
+        QVERIFY(loadFromBuffer(loadedModel, data, loadOptions));
+        QVERIFY(loadObserver.progressCount > 0);
+        QCOMPARE(loadObserver.finishedCount, 1);
+        QCOMPARE(loadObserver.lastStatistics.cellsProcessed, cellCount);
+        QCOMPARE(loadObserver.lastStatistics.cellsTotal, cellCount);
+        // A cancelled save leaves the previous file in place
+        const QString path = m_directory.filePath(QStringLiteral("observed%1%2").arg(format).arg(xmlVersion));
+        options.observer = nullptr;
+        QVERIFY(ModelSerialisation::saveModel(&model, path, testRoles(), options));
+        QFile savedFile(path);
+        QVERIFY(savedFile.open(QIODevice::ReadOnly));
+        const QByteArray savedData = savedFile.readAll();
+        savedFile.close();
+        model.setData(model.index(0, 1), QStringLiteral("changed"));
+        RecordingObserver cancellingSaveObserver(0);
+        options.observer = &cancellingSaveObserver;
+        QVERIFY(!ModelSerialisation::saveModel(&model, path, testRoles(), options));
+        QCOMPARE(cancellingSaveObserver.progressCount, 1);
+        QCOMPARE(cancellingSaveObserver.finishedCount, 1);
+        QVERIFY(savedFile.open(QIODevice::ReadOnly));
+        QCOMPARE(savedFile.readAll(), savedData);
+        // A cancelled load leaves the model empty
+        RecordingObserver cancellingLoadObserver(0);
+        loadOptions.observer = &cancellingLoadObserver;
+        QStandardItemModel cancelledModel;
+        QVERIFY(!loadFromBuffer(cancelledModel, data, loadOptions));
+        QCOMPARE(cancellingLoadObserver.finishedCount, 1);
+        QCOMPARE(cancelledModel.rowCount(), 0);
+        QCOMPARE(cancelledModel.columnCount(), 0);
+    }
+    void lazyLoad()
+    {
+        QStandardItemModel model;
+        model.setRowCount(3);
+        model.setColumnCount(2);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 2; ++j)
+                model.setData(model.index(i, j), QStringLiteral("%1.%2").arg(i).arg(j));
+        }
+        // The last subtree of the document, truncating the document cuts it
+        const QModelIndex parent = model.index(2, 1);
+        model.insertRows(0, 50, parent);
+        model.insertColumns(0, 3, parent);
+        for (int i = 0; i < 50; ++i) {
+            for (int j = 0; j < 3; ++j)
+                model.setData(model.index(i, j, parent), QStringLiteral("child %1.%2").arg(i).arg(j));
+        }
+        ModelSerialisation::SaveOptions options;
+        options.format = ModelSerialisation::BinaryFormat;
+        const QByteArray fullData = saveToBuffer(model, options);
+        QVERIFY(fullData.size() > 2000);
+        QByteArray data = fullData;
+        QBuffer buffer(&data);
+        QVERIFY(buffer.open(QIODevice::ReadOnly));
+        QStandardItemModel loadedModel;
+        ModelSerialisation::LazyLoadProxyModel proxy;
+        QVERIFY(proxy.loadModel(&loadedModel, &buffer));
+        QCOMPARE(proxy.rowCount(), 3);
+        QCOMPARE(proxy.data(proxy.index(1, 1)).toString(), QStringLiteral("1.1"));
+        const QModelIndex proxyParent = proxy.index(2, 1);
+        QCOMPARE(proxy.rowCount(proxyParent), 0);
+        QVERIFY(proxy.hasChildren(proxyParent));
+        QVERIFY(proxy.canFetchMore(proxyParent));
+        QVERIFY(!proxy.hasChildren(proxy.index(0, 0)));
+        // A subtree that can't be read is rolled back and stays pending
+        QSignalSpy errorSpy(&proxy, &ModelSerialisation::LazyLoadProxyModel::loadError);
+        data.chop(1000);
+        proxy.fetchMore(proxyParent);
+        QCOMPARE(errorSpy.count(), 1);
+        QCOMPARE(errorSpy.first().first().value<QModelIndex>(), proxyParent);
+        QCOMPARE(proxy.rowCount(proxyParent), 0);
+        QCOMPARE(proxy.columnCount(proxyParent), 0);
+        QVERIFY(proxy.canFetchMore(proxyParent));
+        data = fullData;
+        proxy.fetchMore(proxyParent);
+        QCOMPARE(errorSpy.count(), 1);
+        QVERIFY(!proxy.canFetchMore(proxyParent));
+        compareLevel(proxy, proxyParent, model, parent, testRoles());
+    }
+    void journalReplay()
+    {
+        const QString path = m_directory.filePath(QStringLiteral("journal.xml"));
+        QStandardItemModel model;
+        fillTree(model);
+        QVERIFY(ModelSerialisation::saveModel(&model, path));
+        ModelSerialisation::ModelJournal journal(&model, path);
+        model.setData(model.index(1, 1), QStringLiteral("first change"));
+        QVERIFY(journal.flush());
+        model.setData(model.index(0, 1, model.index(0, 0)), QColor(Qt::cyan), Qt::BackgroundRole);
+        model.insertRows(1, 2, model.index(0, 0));
+        model.setData(model.index(2, 0, model.index(0, 0)), QStringLiteral("inserted"));
+        model.removeColumns(2, 1);
+        model.setHeaderData(0, Qt::Horizontal, QStringLiteral("renamed"));
+        QVERIFY(journal.hasPendingChanges());
+        QVERIFY(journal.flush());
+        QVERIFY(!journal.hasPendingChanges());
+        QStandardItemModel loadedModel;
+        QVERIFY(ModelSerialisation::loadModel(&loadedModel, path));
+        compareModels(loadedModel, model, ModelSerialisation::modelDefaultRoles());
+    }
+    void tornJournalRecord()
+    {
+        const QString path = m_directory.filePath(QStringLiteral("torn.xml"));
+        QStandardItemModel model;
+        fillTree(model);
+        QVERIFY(ModelSerialisation::saveModel(&model, path));
+        {
+            ModelSerialisation::ModelJournal journal(&model, path);
+            model.setData(model.index(1, 1), QStringLiteral("kept"));
+            QVERIFY(journal.flush());
+            model.setData(model.index(1, 2), QStringLiteral("appended"));
+            QVERIFY(journal.flush());
+            model.setData(model.index(2, 2), QStringLiteral("torn"));
+            QVERIFY(journal.flush());
+        }
+        // An append interrupted by a crash leaves the last record incomplete
+        QFile journalFile(path + QStringLiteral(".journal"));
+        QVERIFY(journalFile.resize(journalFile.size() - 1));
+        QStandardItemModel restoredModel;
+        QVERIFY(ModelSerialisation::loadModel(&restoredModel, path));
+        QCOMPARE(restoredModel.data(restoredModel.index(1, 2)).toString(), QStringLiteral("appended"));
+        QCOMPARE(restoredModel.data(restoredModel.index(2, 2)).toString(), QStringLiteral("2.2 <&>\""));
+        // Changes made after the restart must not be appended behind the torn record
+        ModelSerialisation::ModelJournal journal(&restoredModel, path);
+        restoredModel.setData(restoredModel.index(0, 2), QStringLiteral("after restart"));
+        QVERIFY(journal.flush());
+        QStandardItemModel loadedModel;
+        QVERIFY(ModelSerialisation::loadModel(&loadedModel, path));
+        compareModels(loadedModel, restoredModel, ModelSerialisation::modelDefaultRoles());
+    }
+    void rejectedJournalRecord()
+    {
+        const QString path = m_directory.filePath(QStringLiteral("rejected.xml"));
+        QStandardItemModel model;
+        fillTree(model);
+        QVERIFY(ModelSerialisation::saveModel(&model, path));
+        {
+            ModelSerialisation::ModelJournal journal(&model, path);
+            model.setData(model.index(1, 1), QStringLiteral("rejected"));
+            QVERIFY(journal.flush());
+        }
+        QStandardItemModel acceptingModel;
+        QVERIFY(ModelSerialisation::loadModel(&acceptingModel, path));
+        QCOMPARE(acceptingModel.data(acceptingModel.index(1, 1)).toString(), QStringLiteral("rejected"));
+        // A model that refuses a journal record is not left half way between the snapshot and the journal
+        RejectingItemModel rejectingModel;
+        QVERIFY(!ModelSerialisation::loadModel(&rejectingModel, path));
+        QCOMPARE(rejectingModel.rowCount(), 0);
+        QCOMPARE(rejectingModel.columnCount(), 0);
+    }
+    void asynchronous()
+    {
+        const QString path = m_directory.filePath(QStringLiteral("async.bin"));
+        QStandardItemModel model;
+        fillTree(model);
+        ModelSerialisation::SaveOptions options;
+        options.format = ModelSerialisation::BinaryFormat;
+        QFuture<bool> saved = ModelSerialisation::saveModelAsync(&model, path, testRoles(), options);
+        // Made before the event loop runs the first slice of the copy, so it is saved
+        model.setData(model.index(1, 1), QStringLiteral("changed while saving"));
+        QTRY_VERIFY(saved.isFinished());
+        QVERIFY(saved.result());
+        QStandardItemModel loadedModel;
+        QFuture<bool> loaded = ModelSerialisation::loadModelAsync(&loadedModel, path);
+        QTRY_VERIFY(loaded.isFinished());
+        QVERIFY(loaded.result());
+        compareModels(loadedModel, model, testRoles());
+    }
+    void asynchronousSaveCancelled()
+    {
+        const QString path = m_directory.filePath(QStringLiteral("asyncCancelled.bin"));
+        QStandardItemModel model;
+        fillTable(model, 300, 9);
+        QFuture<bool> saved = ModelSerialisation::saveModelAsync(&model, path);
+        saved.cancel();
+        QTRY_VERIFY(saved.isFinished());
+        QVERIFY(saved.isCanceled());
+        QVERIFY(!QFile::exists(path));
+    }
+};
+
+QTEST_MAIN(ModelSerialisationTest)
+#include "tst_modelserialisation.moc"